@@ -0,0 +1,248 @@
+#!/usr/bin/env python3
+"""
+Accuracy and throughput of the C++ library against the NumPy reference of
+harmonic.py. Both fit the same signals, generated ones of increasing size and
+the recorded fixtures. The amplitudes and phases must agree within tolerance,
+or the residual norms when the problem is too ill-conditioned for the
+components to be unique. Times and peak memory are recorded for each.
+
+Needs src/bench (make -C src bench). Exits with 1 on any disagreement.
+"""
+import argparse
+import json
+import os
+import subprocess
+import sys
+import tempfile
+import time
+from datetime import datetime
+
+import numpy as np
+from scipy.optimize import lsq_linear
+
+from harmonic import create_lsq_matrix, get_amplitude, get_phase, tidal_constituents
+
+ROOT = os.path.dirname(os.path.abspath(__file__))
+FIXTURES = ["src/test_data.txt", "wasm/test_data.txt"]
+METHODS = ["svd", "workspace"]
+
+# beyond this condition number of A only the residuals are compared
+MAX_CONDITION = 1.0e8
+AMPLITUDE_TOL = 1.0e-6  # relative to the largest amplitude
+PHASE_TOL = 1.0e-6  # rad, for the constituents above MIN_AMPLITUDE
+MIN_AMPLITUDE = 1.0e-3  # relative to the largest amplitude
+# relative excess of the residual norm, loose since the huge coefficients of a
+# rank deficient fit lose digits going through amplitudes and phases
+RESIDUAL_TOL = 1.0e-4
+
+
+def read_station(fname):
+    """Date;Value;Source records, times in hours since the first one"""
+    t, h = [], []
+    t0 = None
+    with open(fname, encoding="utf-8") as f:
+        for line in f:
+            cols = line.strip().split(";")
+            if line.startswith("#") or len(cols) < 2:
+                continue
+            try:
+                date = datetime.strptime(cols[0], "%d/%m/%Y %H:%M:%S")
+                value = float(cols[1])
+            except ValueError:
+                continue
+            t0 = t0 or date
+            t.append((date - t0).total_seconds() / 3600.0)
+            h.append(value)
+    return np.array(t), np.array(h)
+
+
+def generate(m, seed):
+    """Hourly signal with random constituents and a 5 cm noise"""
+    pulsation = np.array([np.pi * a / 180.0 for a in tidal_constituents.values()])
+    rng = np.random.default_rng(seed)
+    amplitude = rng.uniform(0.05, 1.5, len(pulsation))
+    phase = rng.uniform(-np.pi, np.pi, len(pulsation))
+    t = np.arange(m, dtype=np.float64)
+    h = np.zeros(m)
+    for start in range(0, m, 100000):
+        tb = t[start : start + 100000]
+        h[start : start + 100000] = (
+            np.cos(np.outer(tb, pulsation) + phase) @ amplitude
+        )
+    return t, h + 2.0 + rng.normal(0.0, 0.05, m)
+
+
+def peak_rss_kb():
+    """high water mark of the resident memory of this process"""
+    with open("/proc/self/status", encoding="utf-8") as f:
+        for line in f:
+            if line.startswith("VmHWM:"):
+                return float(line.split()[1])
+    return float("nan")
+
+
+def numpy_fit(fname, pulsation, repeats):
+    """Runs in its own process so that its peak resident memory compares with
+    the one of the C++ bench, reading the same file"""
+    t, h = np.loadtxt(fname, unpack=True)
+    h = h - h.mean()
+    best = float("inf")
+    for _ in range(repeats):
+        begin = time.perf_counter()
+        A = create_lsq_matrix(t, pulsation)
+        x = lsq_linear(A, h)["x"]
+        best = min(best, time.perf_counter() - begin)
+    peak = peak_rss_kb()
+
+    # residual of the minimum norm solution which drops the singular values
+    # below eps max(m, n) s_max, close to the eps min(m, n) s_max of Eigen
+    x_min = np.linalg.lstsq(A, h, rcond=None)[0]
+
+    return {
+        "residual": float(np.linalg.norm(h - A @ x_min)),
+        "amplitudes": get_amplitude(x).tolist(),
+        "phases": get_phase(x).tolist(),
+        "condition": float(np.linalg.cond(A)),
+        "time_s": best,
+        "peak_kb": peak,
+    }
+
+
+def numpy_child(fname, pulsation, repeats):
+    run = subprocess.run(
+        [
+            sys.executable,
+            os.path.abspath(__file__),
+            "--numpy-fit",
+            fname,
+            "--pulsations",
+            json.dumps(list(pulsation)),
+            "--repeats",
+            str(repeats),
+        ],
+        capture_output=True,
+        text=True,
+        check=True,
+    )
+    ref = json.loads(run.stdout)
+    ref["amplitudes"] = np.array(ref["amplitudes"])
+    ref["phases"] = np.array(ref["phases"])
+    return ref
+
+
+def cpp_fit(bench, fname, method, repeats):
+    run = subprocess.run(
+        [bench, fname, method, str(repeats)], capture_output=True, text=True
+    )
+    if run.returncode != 0:
+        return {"error": (run.stdout + run.stderr).strip().splitlines()[-1]}
+    return json.loads(run.stdout)
+
+
+def wrap(x):
+    return (x + np.pi) % (2.0 * np.pi) - np.pi
+
+
+def compare(t, h, pulsation, ref, res):
+    """largest deviations and whether they are within tolerance"""
+    a_ref, a = ref["amplitudes"], np.array(res["amplitudes"])
+    scale = max(a_ref.max(), 1.0e-12)
+    if ref["condition"] < MAX_CONDITION:
+        shown = a_ref > MIN_AMPLITUDE * scale
+        da = np.abs(a - a_ref).max() / scale
+        dp = np.abs(wrap(np.array(res["phases"]) - ref["phases"]))[shown].max()
+        return "components", da, dp, da <= AMPLITUDE_TOL and dp <= PHASE_TOL
+
+    # rank deficient : the components aren't unique and the residual depends
+    # on where the singular values are cut, the reference is the truncated one
+    A = create_lsq_matrix(t, pulsation)
+    # a cos(w t + p) = a cos(p) cos(w t) - a sin(p) sin(w t)
+    x = np.zeros(2 * len(pulsation))
+    x[::2] = a * np.cos(np.array(res["phases"]))
+    x[1::2] = -a * np.sin(np.array(res["phases"]))
+    r = np.linalg.norm(h - A @ x)
+    r_ref = ref["residual"]
+    dr = (r - r_ref) / max(r_ref, 1.0e-12 * np.linalg.norm(h))
+    return "residual", dr, float("nan"), dr <= RESIDUAL_TOL
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.strip().split("\n")[0])
+    parser.add_argument("--bench", default=os.path.join(ROOT, "src", "bench"))
+    parser.add_argument(
+        "--sizes", type=int, nargs="*", default=[1000, 10000, 100000, 1000000]
+    )
+    parser.add_argument("--repeats", type=int, default=3)
+    parser.add_argument("--output", default=os.path.join(ROOT, "bench_output.txt"))
+    # the NumPy fit of one file, run as a child process
+    parser.add_argument("--numpy-fit", help=argparse.SUPPRESS)
+    parser.add_argument("--pulsations", help=argparse.SUPPRESS)
+    args = parser.parse_args()
+
+    if args.numpy_fit:
+        pulsation = np.array(json.loads(args.pulsations))
+        print(json.dumps(numpy_fit(args.numpy_fit, pulsation, args.repeats)))
+        return
+
+    if not os.path.exists(args.bench):
+        sys.exit(f"{args.bench} not found, build it with make -C src bench")
+
+    cases = [(f"generated_{m}", *generate(m, seed=m)) for m in args.sizes]
+    cases += [(f, *read_station(os.path.join(ROOT, f))) for f in FIXTURES]
+
+    header = (
+        f"{'case':<24}{'samples':>9}{'cond':>10}{'impl':>11}{'time_s':>11}"
+        f"{'peak_kb':>11}{'speedup':>9}  {'compared':<11}{'d_amp':>10}"
+        f"{'d_phase':>10}  status"
+    )
+    lines = [header]
+    print(header, flush=True)
+    failed = False
+
+    with tempfile.TemporaryDirectory() as tmp:
+        for name, t, h in cases:
+            fname = os.path.join(tmp, "fixture.txt")
+            np.savetxt(fname, np.column_stack([t, h]), fmt="%.17g")
+
+            # the pulsations and their order come from the library
+            probe = cpp_fit(args.bench, fname, "svd", 1)
+            if "error" in probe:
+                sys.exit(f"{name} : {probe['error']}")
+            pulsation = np.array(probe["pulsations"])
+
+            ref = numpy_child(fname, pulsation, args.repeats)
+            lines.append(
+                f"{name:<24}{len(t):>9}{ref['condition']:>10.2e}{'numpy':>11}"
+                f"{ref['time_s']:>11.4f}{ref['peak_kb']:>11.0f}"
+            )
+
+            for method in METHODS:
+                res = cpp_fit(args.bench, fname, method, args.repeats)
+                prefix = f"{'':<24}{'':>9}{'':>10}{method:>11}"
+                if "error" in res:
+                    lines.append(f"{prefix}  {res['error']}  FAILED")
+                    failed = True
+                    continue
+
+                compared, da, dp, ok = compare(t, h - h.mean(), pulsation, ref, res)
+                failed |= not ok
+                lines.append(
+                    f"{prefix}{res['time_s']:>11.4f}{res['peak_rss_kb']:>11.0f}"
+                    f"{ref['time_s'] / max(res['time_s'], 1.0e-9):>9.1f}  "
+                    f"{compared:<11}{da:>10.1e}{dp:>10.1e}  "
+                    f"{'ok' if ok else 'FAILED'}"
+                )
+            print("\n".join(lines[-1 - len(METHODS) :]), flush=True)
+
+    footer = (
+        "peak_kb : maximum resident set of the process running the fit, "
+        "the interpreter and its modules included for numpy"
+    )
+    with open(args.output, "w", encoding="utf-8") as f:
+        f.write("\n".join(lines + ["", footer]) + "\n")
+    print(f"\nresults written to {args.output}")
+    sys.exit(1 if failed else 0)
+
+
+if __name__ == "__main__":
+    main()
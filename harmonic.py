@@ -1,8 +1,6 @@
 #!/usr/bin/env python3
-import pandas as pd
 import numpy as np
 from scipy.optimize import lsq_linear
-import matplotlib.pyplot as plt
 
 tidal_constituents = {
     "M2": 28.9841042,  # Principal lunar semidiurnal degrees/hour
@@ -50,28 +48,32 @@ def tide_serie(t, pulsation, phase, amplitude):
     return h
 
 
-col_names = ["date", "val", "source"]
-data = pd.read_csv("95_2024.txt", header=0, skiprows=13, sep=";", names=col_names)
-data["date"] = pd.to_datetime(data["date"], format="%d/%m/%Y %H:%M:%S")
-data["val"] -= data["val"].mean()
-data["date"] = (data["date"] - data["date"].iloc[0]) // pd.Timedelta("1h")
-h = data["val"].to_numpy()
-t = data["date"].to_numpy()
+if __name__ == "__main__":
+    import pandas as pd
+    import matplotlib.pyplot as plt
 
-pulsation = np.array([np.pi * a / 180.0 for _, a in tidal_constituents.items()])
-constituants_names = np.array([name for name, _ in tidal_constituents.items()])
+    col_names = ["date", "val", "source"]
+    data = pd.read_csv("95_2024.txt", header=0, skiprows=13, sep=";", names=col_names)
+    data["date"] = pd.to_datetime(data["date"], format="%d/%m/%Y %H:%M:%S")
+    data["val"] -= data["val"].mean()
+    data["date"] = (data["date"] - data["date"].iloc[0]) // pd.Timedelta("1h")
+    h = data["val"].to_numpy()
+    t = data["date"].to_numpy()
 
-A = create_lsq_matrix(t, pulsation)
-x = lsq_linear(A, h)["x"]
-data.plot(x="date", y="val")
-ax = plt.gca()
-t_plot = np.linspace(t[0], t[-1], 2 * len(t))
-# A = create_lsq_matrix(t_plot, pulsation)
-# ax.plot(t_plot, A @ x, "r")
-amplitude = get_amplitude(x)
-phase = get_phase(x)
-ax.plot(t_plot, tide_serie(t_plot, pulsation, phase, amplitude), "r")
-ax.set_xlim((1000, 1500))
+    pulsation = np.array([np.pi * a / 180.0 for _, a in tidal_constituents.items()])
+    constituants_names = np.array([name for name, _ in tidal_constituents.items()])
 
-print(f"condition number : {np.linalg.cond(A.T @ A)}")
-plt.show()
+    A = create_lsq_matrix(t, pulsation)
+    x = lsq_linear(A, h)["x"]
+    data.plot(x="date", y="val")
+    ax = plt.gca()
+    t_plot = np.linspace(t[0], t[-1], 2 * len(t))
+    # A = create_lsq_matrix(t_plot, pulsation)
+    # ax.plot(t_plot, A @ x, "r")
+    amplitude = get_amplitude(x)
+    phase = get_phase(x)
+    ax.plot(t_plot, tide_serie(t_plot, pulsation, phase, amplitude), "r")
+    ax.set_xlim((1000, 1500))
+
+    print(f"condition number : {np.linalg.cond(A.T @ A)}")
+    plt.show()
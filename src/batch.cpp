@@ -0,0 +1,215 @@
+#include "tide_harmonics.hpp"
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <thread>
+#include <vector>
+
+/* Harmonic analysis of every station file of a directory. Reader threads
+ * parse the files while worker threads fit them, the two sides are linked by
+ * a bounded queue so the parsed records don't pile up in memory. A file that
+ * can't be read or fitted is reported in the results table instead of
+ * stopping the batch. */
+
+struct Record {
+  std::size_t index;
+  std::vector<double> t;
+  std::vector<double> h;
+  std::string error;
+};
+
+struct Result {
+  bool ok{false};
+  std::size_t samples{0};
+  double mean{0};
+  double error_mean{0};
+  std::vector<double> amplitudes;
+  std::vector<double> phases;
+  std::string error;
+};
+
+template <typename Item> class BoundedQueue {
+public:
+  explicit BoundedQueue(std::size_t capacity) : capacity(capacity) {};
+
+  void push(Item item) {
+    std::unique_lock lock(mutex);
+    not_full.wait(lock, [&] { return items.size() < capacity; });
+    items.push_back(std::move(item));
+    not_empty.notify_one();
+  }
+
+  auto pop() -> std::optional<Item> {
+    /* empty once the queue is closed and drained */
+    std::unique_lock lock(mutex);
+    not_empty.wait(lock, [&] { return !items.empty() || closed; });
+    if (items.empty()) {
+      return std::nullopt;
+    }
+    Item item = std::move(items.front());
+    items.pop_front();
+    not_full.notify_one();
+    return item;
+  }
+
+  void close() {
+    std::lock_guard lock(mutex);
+    closed = true;
+    not_empty.notify_all();
+  }
+
+private:
+  std::size_t capacity;
+  std::deque<Item> items;
+  bool closed{false};
+  std::mutex mutex;
+  std::condition_variable not_full;
+  std::condition_variable not_empty;
+};
+
+auto one_line(std::string msg) -> std::string {
+  std::replace(msg.begin(), msg.end(), '\n', ' ');
+  std::replace(msg.begin(), msg.end(), '\t', ' ');
+  while (!msg.empty() && msg.back() == ' ') {
+    msg.pop_back();
+  }
+  return msg;
+}
+
+void write_results(const std::string &fname,
+                   const std::vector<std::filesystem::path> &files,
+                   const std::vector<Result> &results,
+                   const std::vector<std::string> &names) {
+  std::ofstream file(fname);
+  if (file.fail()) {
+    throw std::runtime_error("can't open : " + fname + "\n");
+  }
+  file.precision(10);
+
+  file << "file\tstatus\tsamples\tmean\terror_mean";
+  for (const auto &name : names) {
+    file << "\t" << name << "_amplitude\t" << name << "_phase";
+  }
+  file << "\tmessage\n";
+
+  for (std::size_t k = 0; k < files.size(); ++k) {
+    const Result &r = results.at(k);
+    file << files.at(k).filename().string() << "\t"
+         << (r.ok ? "ok" : "error") << "\t" << r.samples << "\t";
+    if (r.ok) {
+      file << r.mean << "\t" << r.error_mean;
+      for (std::size_t j = 0; j < names.size(); ++j) {
+        file << "\t" << r.amplitudes.at(j) << "\t" << r.phases.at(j);
+      }
+    } else {
+      file << "nan\tnan";
+      for (std::size_t j = 0; j < names.size(); ++j) {
+        file << "\tnan\tnan";
+      }
+    }
+    file << "\t" << one_line(r.error) << "\n";
+  }
+}
+
+auto main(int argc, char *argv[]) -> int {
+  if (argc < 3 || argc > 5) {
+    std::cout << "usage : " << argv[0]
+              << " <station directory> <results file> [readers] [workers]\n";
+    return 1;
+  }
+
+  auto n_cores = (int)std::max(1U, std::thread::hardware_concurrency());
+  int n_readers = argc > 3 ? std::stoi(argv[3]) : std::max(1, n_cores / 4);
+  int n_workers = argc > 4 ? std::stoi(argv[4]) : n_cores;
+  if (n_readers < 1 || n_workers < 1) {
+    std::cout << "Error, needs at least one reader and one worker\n";
+    return 1;
+  }
+
+  std::vector<std::filesystem::path> files;
+  for (const auto &entry : std::filesystem::directory_iterator(argv[1])) {
+    if (entry.is_regular_file()) {
+      files.push_back(entry.path());
+    }
+  }
+  std::sort(files.begin(), files.end());
+
+  std::vector<std::string> names;
+  std::vector<double> pulsations;
+  Tide::get_constituants_const(names, pulsations);
+
+  std::vector<Result> results(files.size());
+  BoundedQueue<Record> queue(2 * (std::size_t)n_workers);
+  std::atomic<std::size_t> next_file{0};
+  std::atomic<int> readers_left{n_readers};
+
+  auto reader = [&]() {
+    for (std::size_t k = next_file++; k < files.size(); k = next_file++) {
+      Record record{k, {}, {}, {}};
+      try {
+        read_csv_data(files.at(k).string(), record.t, record.h);
+      } catch (const std::exception &e) {
+        record.error = std::string("read error : ") + e.what();
+      }
+      queue.push(std::move(record));
+    }
+    if (--readers_left == 0) {
+      queue.close();
+    }
+  };
+
+  auto worker = [&]() {
+    while (std::optional<Record> record = queue.pop()) {
+      Result &r = results.at(record->index);
+      r.samples = record->t.size();
+      if (!record->error.empty()) {
+        r.error = record->error;
+        continue;
+      }
+      try {
+        if (record->t.size() != record->h.size() || record->t.empty()) {
+          throw std::runtime_error("times and heights don't match");
+        }
+        r.mean = Tide::mean(record->h);
+        for (auto &v : record->h) {
+          v -= r.mean;
+        }
+        Components components(pulsations);
+        components.harmonic_analysis(record->t, record->h);
+        r.error_mean = components.error_mean(record->t, record->h);
+        r.amplitudes = components.amplitudes;
+        r.phases = components.phases;
+        r.ok = true;
+      } catch (const std::exception &e) {
+        r.error = std::string("fit error : ") + e.what();
+      }
+    }
+  };
+
+  std::vector<std::thread> threads;
+  for (int i = 0; i < n_readers; ++i) {
+    threads.emplace_back(reader);
+  }
+  for (int i = 0; i < n_workers; ++i) {
+    threads.emplace_back(worker);
+  }
+  for (auto &thread : threads) {
+    thread.join();
+  }
+
+  write_results(argv[2], files, results, names);
+
+  auto n_ok = std::count_if(results.begin(), results.end(),
+                            [](const Result &r) { return r.ok; });
+  std::cout << n_ok << " stations analysed, " << (long int)results.size() - n_ok
+            << " failed\n";
+
+  return n_ok == (long int)results.size() ? 0 : 2;
+}
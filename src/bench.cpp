@@ -0,0 +1,117 @@
+#include "tide_harmonics.hpp"
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <optional>
+#include <sstream>
+#include <string>
+#include <vector>
+
+/* Fits the tidal constituents of a "time value" file, time in hours, with one
+ * method of Components and prints the components, the best time out of the
+ * repeats and the peak memory as a JSON line. Used by bench_compare.py to
+ * check the library against the NumPy reference of harmonic.py. */
+
+auto read_file(const std::string &fname) -> std::string {
+  std::ifstream file(fname);
+  if (file.fail()) {
+    throw std::runtime_error("can't open : " + fname);
+  }
+  std::stringstream buffer;
+  buffer << file.rdbuf();
+  return buffer.str();
+}
+
+auto peak_rss_kb() -> long int {
+  /* high water mark of the resident memory, unlike getrusage it isn't
+   * inherited from the process that started this one */
+  std::ifstream status("/proc/self/status");
+  std::string line;
+  while (std::getline(status, line)) {
+    if (line.starts_with("VmHWM:")) {
+      return std::stol(line.substr(6));
+    }
+  }
+  return -1;
+}
+
+auto json_array(const std::vector<double> &x) -> std::string {
+  std::string str = "[";
+  for (std::size_t i = 0; i < x.size(); ++i) {
+    std::array<char, 32> buffer{};
+    std::snprintf(buffer.data(), buffer.size(), "%.17g", x[i]);
+    str += (i > 0 ? "," : "") + std::string(buffer.data());
+  }
+  return str + "]";
+}
+
+auto main(int argc, char *argv[]) -> int {
+  if (argc < 3 || argc > 4) {
+    std::cout << "usage : " << argv[0]
+              << " <time value file> <svd|workspace> [repeats]\n";
+    return 1;
+  }
+  std::string method = argv[2];
+  int repeats = argc > 3 ? std::stoi(argv[3]) : 3;
+  if (method != "svd" && method != "workspace") {
+    std::cout << "Error, unknown method : " << method << "\n";
+    return 1;
+  }
+
+  std::vector<double> t;
+  std::vector<double> h;
+  std::string datetime;
+  try {
+    read_csv_string_units(read_file(argv[1]), ' ', 0, 1, 3600.0, t, h,
+                          datetime);
+  } catch (const std::exception &e) {
+    std::cout << "Error, " << e.what() << "\n";
+    return 1;
+  }
+
+  double h_m = Tide::mean(h);
+  for (auto &v : h) {
+    v -= h_m;
+  }
+
+  std::vector<std::string> names;
+  std::vector<double> pulsations;
+  Tide::get_constituants_const(names, pulsations);
+  Components components(pulsations);
+
+  double best = 1.0e300;
+  try {
+    // allocated once as in a sweep of fits, outside of the timings
+    std::optional<Workspace<double>> ws;
+    if (method == "workspace") {
+      ws.emplace((long int)t.size(), (long int)pulsations.size());
+    }
+    for (int r = 0; r < std::max(1, repeats); ++r) {
+      auto begin = std::chrono::steady_clock::now();
+      if (method == "svd") {
+        components.harmonic_analysis(t, h);
+      } else {
+        components.harmonic_analysis(t, h, *ws);
+      }
+      auto end = std::chrono::steady_clock::now();
+      best = std::min(best, std::chrono::duration<double>(end - begin).count());
+    }
+  } catch (const std::exception &e) {
+    std::cout << "Error, " << e.what();
+    return 1;
+  }
+
+  std::cout << "{\"method\":\"" << method << "\",\"samples\":" << t.size()
+            << ",\"time_s\":" << best << ",\"peak_rss_kb\":" << peak_rss_kb()
+            << ",\"names\":[";
+  for (std::size_t j = 0; j < names.size(); ++j) {
+    std::cout << (j > 0 ? "," : "") << "\"" << names[j] << "\"";
+  }
+  std::cout << "],\"pulsations\":" << json_array(components.pulsations)
+            << ",\"amplitudes\":" << json_array(components.amplitudes)
+            << ",\"phases\":" << json_array(components.phases) << "}\n";
+  return 0;
+}
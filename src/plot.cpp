@@ -49,8 +49,12 @@ auto main() -> int {
 
   components.harmonic_analysis(t, h);
 
+  // 0.1 mm is well below what the plot can show
   auto t_fit = range(t.at(0), t.at(t.size() - 1), (int)t.size() * 4);
-  std::vector<double> h_fit = components.harmonic_series(t_fit);
+  double max_error{0};
+  std::vector<double> h_fit =
+      components.harmonic_series_approx(t_fit, 1.0e-4, max_error);
+  std::cout << "fit curve interpolation error : " << max_error << "\n";
 
   write_data("data_fit.txt", t_fit, h_fit);
 
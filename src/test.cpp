@@ -1,11 +1,33 @@
 #include "eigen-3.4.0/Eigen/Dense"
 #include "tide_harmonics.hpp"
+#include <algorithm>
 #include <cassert>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
 #include <fstream>
 #include <iostream>
+#include <new>
+#include <random>
 #include <string>
 #include <vector>
 
+// counts the allocations done through new, Eigen's are checked with
+// EIGEN_RUNTIME_NO_MALLOC
+static long int n_allocations = 0;
+
+auto operator new(std::size_t size) -> void * {
+  ++n_allocations;
+  if (void *p = std::malloc(size)) {
+    return p;
+  }
+  throw std::bad_alloc();
+}
+
+void operator delete(void *p) noexcept { std::free(p); }
+
+void operator delete(void *p, std::size_t /*size*/) noexcept { std::free(p); }
+
 const std::vector<double> Pulsations = {
     0.262516,    //
     0.525032,    //
@@ -124,6 +146,35 @@ auto test_read_csv_data() {
   assert(error < 1.0e-2);
 }
 
+auto test_read_csv_data_error() {
+  std::vector<double> t;
+  std::vector<double> h;
+  bool thrown = false;
+  try {
+    read_csv_data("missing_file.txt", t, h);
+  } catch (const std::runtime_error &) {
+    thrown = true;
+  }
+  std::cout << "read_csv_data on a missing file throws : " << thrown << "\n";
+  assert(thrown);
+
+  std::string fname = "test_invalid_date.txt";
+  {
+    std::ofstream file(fname);
+    file << "01/01/2020 00:00:00;1.0;1\n"
+         << "not a date;2.0;1\n";
+  }
+  thrown = false;
+  try {
+    read_csv_data(fname, t, h);
+  } catch (const std::runtime_error &) {
+    thrown = true;
+  }
+  std::remove(fname.c_str());
+  std::cout << "read_csv_data on an invalid date throws : " << thrown << "\n";
+  assert(thrown);
+}
+
 auto test_read_csv_string() {
   std::vector<double> t;
   std::vector<double> h;
@@ -192,16 +243,392 @@ auto test_read_csv_string_units() {
   assert(error < 1.0e-12);
 }
 
+auto test_uncertainty() {
+  Components components(Pulsations);
+  components.set_amplitudes(Amplitudes);
+  components.set_phases(Phases);
+
+  std::vector<double> t = range(0.0, 20000.0, 20000);
+  std::vector<double> h = components.harmonic_series(t);
+
+  std::mt19937 gen(42);
+  std::normal_distribution<double> noise(0.0, 0.1);
+  for (auto &v : h) {
+    v += noise(gen);
+  }
+
+  for (auto method : {Tide::Resampling::ResidualBootstrap,
+                      Tide::Resampling::NoiseInjection}) {
+    Components<double> fit(Pulsations);
+    Tide::Uncertainty<double> u = fit.uncertainty(t, h, 2000, method);
+
+    // for white noise the amplitude deviation is sigma * sqrt(2 / m)
+    double expected_std = 0.1 * std::sqrt(2.0 / (double)t.size());
+    int covered = 0;
+    for (int j = 0; j < (int)Amplitudes.size(); ++j) {
+      assert(std::abs(u.amplitudes_std.at(j) / expected_std - 1.0) < 0.2);
+      assert(u.amplitudes_low.at(j) <= fit.amplitudes.at(j));
+      assert(fit.amplitudes.at(j) <= u.amplitudes_high.at(j));
+      if (u.amplitudes_low.at(j) <= Amplitudes.at(j) &&
+          Amplitudes.at(j) <= u.amplitudes_high.at(j)) {
+        ++covered;
+      }
+    }
+    std::cout << "uncertainty, true amplitudes in 95% interval : " << covered
+              << "/" << Amplitudes.size()
+              << ", M2 amplitude std : " << u.amplitudes_std.at(0) << "\n";
+    assert(covered >= 10);
+  }
+
+  // a mean the constituents can't fit isn't resampled, which would shift
+  // every replicate the same way and the intervals away from the fit
+  for (auto &v : h) {
+    v += 2.0;
+  }
+  Components<double> fit(Pulsations);
+  Tide::Uncertainty<double> u =
+      fit.uncertainty(t, h, 2000, Tide::Resampling::ResidualBootstrap);
+  double shift{0};
+  for (int j = 0; j < (int)Amplitudes.size(); ++j) {
+    double middle = 0.5 * (u.amplitudes_low.at(j) + u.amplitudes_high.at(j));
+    double half = 0.5 * (u.amplitudes_high.at(j) - u.amplitudes_low.at(j));
+    shift = std::max(shift, std::abs(middle - fit.amplitudes.at(j)) / half);
+  }
+  std::cout << "uncertainty with an offset, interval shift / half width : "
+            << shift << "\n";
+  assert(shift < 0.5);
+}
+
+auto test_predict_stations() {
+  std::vector<Components<double>> stations;
+  for (int s = 0; s < 5; ++s) {
+    std::vector<double> amplitudes = Amplitudes;
+    std::vector<double> phases = Phases;
+    for (int j = 0; j < (int)Amplitudes.size(); ++j) {
+      amplitudes.at(j) *= 1.0 + 0.1 * s;
+      phases.at(j) += 0.3 * s;
+    }
+    stations.emplace_back(Pulsations, amplitudes, phases);
+  }
+
+  std::vector<double> t = range(0.0, 20000.0, 2000);
+  auto C = Tide::station_coefficients(stations);
+  auto H_t = Tide::predict_stations(Pulsations, C, t, Tide::Layout::TimeMajor);
+  auto H_s =
+      Tide::predict_stations(Pulsations, C, t, Tide::Layout::StationMajor);
+
+  double error{0};
+  for (int s = 0; s < (int)stations.size(); ++s) {
+    std::vector<double> h = stations.at(s).harmonic_series(t);
+    for (int i = 0; i < (int)t.size(); ++i) {
+      error = std::max(error, std::abs(H_t(i, s) - h.at(i)));
+      error = std::max(error, std::abs(H_s(s, i) - h.at(i)));
+    }
+  }
+  std::cout << "predict_stations, error inf : " << error << "\n";
+  assert(error < 1.0e-11);
+}
+
+auto test_read_csv_columns() {
+  std::vector<double> t = range(0.0, 20000.0, 20000);
+  std::vector<std::vector<double>> columns;
+  std::vector<double> scales = {1.0, 0.5, 2.0};
+  for (double scale : scales) {
+    std::vector<double> amplitudes = Amplitudes;
+    for (auto &a : amplitudes) {
+      a *= scale;
+    }
+    Components components(Pulsations, amplitudes, Phases);
+    columns.push_back(components.harmonic_series(t));
+  }
+
+  std::stringstream ss;
+  ss.precision(14);
+  ss << std::scientific;
+  for (int i = 0; i < (int)t.size(); ++i) {
+    ss << t.at(i) << " " << columns.at(0).at(i) << " " << columns.at(1).at(i)
+       << " " << columns.at(2).at(i) << "\n";
+  }
+
+  std::vector<double> t_read;
+  Eigen::MatrixXd H;
+  std::string datetime;
+  read_csv_string_units(ss.str(), ' ', 0, {3, 1, 2}, 3600.0, t_read, H,
+                        datetime);
+  assert(H.rows() == (long int)t.size() && H.cols() == 3);
+
+  Components<double> components(Pulsations);
+  std::vector<Components<double>> fits =
+      components.harmonic_analysis_columns(t_read, H);
+
+  double error{0};
+  for (int c = 0; c < 3; ++c) {
+    std::vector<double> h(H.col(c).data(), H.col(c).data() + H.rows());
+    error = std::max(error, fits.at(c).error_inf(t_read, h));
+  }
+  std::cout << "read_csv_string_units columns, error inf : " << error << "\n";
+  assert(error < 1.0e-11);
+  assert(std::abs(fits.at(0).amplitudes.at(3) - 2.0 * Amplitudes.at(3)) <
+         1.0e-12);
+
+  // a missing value only removes its row from the fit of its column, the
+  // last two columns share their gap
+  H(3, 0) = std::nan("");
+  H(7, 1) = std::nan("");
+  H(7, 2) = std::nan("");
+  fits = components.harmonic_analysis_columns(t_read, H);
+  error = 0;
+  for (int j = 0; j < (int)Amplitudes.size(); ++j) {
+    error = std::max(error, std::abs(fits.at(0).amplitudes.at(j) -
+                                     2.0 * Amplitudes.at(j)));
+    error = std::max(error, std::abs(fits.at(1).amplitudes.at(j) -
+                                     Amplitudes.at(j)));
+    error = std::max(error, std::abs(fits.at(2).amplitudes.at(j) -
+                                     0.5 * Amplitudes.at(j)));
+  }
+  std::cout << "read_csv_string_units columns with NaN, error inf : " << error
+            << "\n";
+  assert(error < 1.0e-11);
+
+  // one column read with the datetime format matches the single column reader
+  std::ifstream file("test_data.txt");
+  std::stringstream buffer;
+  buffer << file.rdbuf();
+  const char *format = "%d/%m/%Y %H:%M:%S";
+  std::vector<double> t_single;
+  std::vector<double> h_single;
+  read_csv_string(buffer.str(), format, ';', 0, 1, t_single, h_single,
+                  datetime);
+  read_csv_string(buffer.str(), format, ';', 0, {1, 1}, t_read, H, datetime);
+  assert(t_read == t_single);
+  for (int i = 0; i < (int)h_single.size(); ++i) {
+    assert(H(i, 0) == h_single.at(i) && H(i, 1) == h_single.at(i));
+  }
+}
+
+auto test_workspace() {
+  Components components(Pulsations, Amplitudes, Phases);
+  std::vector<double> t = range(0.0, 20000.0, 20000);
+  std::vector<double> h = components.harmonic_series(t);
+
+  const long int window = 9000;
+  Workspace<double> ws(window, (long int)Pulsations.size());
+  Components<double> fit(Pulsations);
+
+  auto sweep = [&]() {
+    double error{0};
+    for (long int i0 = 0; i0 + window <= (long int)t.size(); i0 += 500) {
+      // windows of varying length, up to the workspace size
+      long int m = window - (i0 % 1000);
+      std::span<const double> t_w(t.data() + i0, m);
+      std::span<const double> h_w(h.data() + i0, m);
+      fit.harmonic_analysis(t_w, h_w, ws);
+      double e_inf = fit.error_inf(t_w, h_w, ws);
+      assert(fit.error_mean(t_w, h_w, ws) <= e_inf);
+      assert(fit.error_2(t_w, h_w, ws) <= e_inf * e_inf * (double)m);
+      error = std::max(error, e_inf);
+    }
+    return error;
+  };
+
+  sweep();
+
+  long int n_before = n_allocations;
+  Eigen::internal::set_is_malloc_allowed(false);
+  double error = sweep();
+  Eigen::internal::set_is_malloc_allowed(true);
+  long int n_steady = n_allocations - n_before;
+
+  std::cout << "workspace, error inf : " << error
+            << ", allocations : " << n_steady << "\n";
+  assert(error < 1.0e-9);
+  assert(n_steady == 0);
+
+  // rank deficient, 46 samples can't resolve the long period constituents,
+  // the residual matches the SVD fit up to the digits lost by the huge
+  // coefficients of the unresolved constituents
+  std::vector<double> t_short;
+  std::vector<double> h_short;
+  read_csv_data("test_data.txt", t_short, h_short);
+  double h_m = Tide::mean(h_short);
+  for (auto &v : h_short) {
+    v -= h_m;
+  }
+  std::vector<std::string> names;
+  std::vector<double> pulsations;
+  Tide::get_constituants_const(names, pulsations);
+  Components<double> fit_svd(pulsations);
+  Components<double> fit_ws(pulsations);
+  Workspace<double> ws_short((long int)t_short.size(),
+                             (long int)pulsations.size());
+  fit_svd.harmonic_analysis(t_short, h_short);
+  fit_ws.harmonic_analysis(t_short, h_short, ws_short);
+  double r_svd = fit_svd.error_2(t_short, h_short);
+  double r_ws = fit_ws.error_2(t_short, h_short);
+  std::cout << "workspace rank deficient, residual : " << r_ws
+            << ", svd residual : " << r_svd << "\n";
+  assert(std::abs(r_ws - r_svd) <= 1.0e-3 * r_svd);
+}
+
+auto test_weighted_robust() {
+  Components components(Pulsations, Amplitudes, Phases);
+  std::vector<double> t = range(0.0, 20000.0, 20000);
+  std::vector<double> h_clean = components.harmonic_series(t);
+
+  // gaps as NaN and spikes, the mask only knows about the first spikes
+  std::vector<double> h = h_clean;
+  std::vector<double> mask(h.size(), 1.0);
+  for (int i = 0; i < (int)h.size(); i += 37) {
+    h.at(i) = std::nan("");
+  }
+  for (int i = 5; i < (int)h.size(); i += 101) {
+    h.at(i) += 5.0;
+    mask.at(i) = 0.0;
+  }
+  for (int i = 11; i < (int)h.size(); i += 53) {
+    h.at(i) -= 3.0;
+  }
+
+  Components<double> fit(Pulsations);
+  Workspace<double> ws((long int)t.size(), (long int)Pulsations.size());
+  std::vector<double> h_masked = h;
+  for (int i = 11; i < (int)h.size(); i += 53) {
+    h_masked.at(i) = h_clean.at(i);
+  }
+  fit.harmonic_analysis(t, h_masked, mask, ws);
+  double error = fit.error_inf(t, h_clean, ws);
+  std::cout << "weighted harmonic_analysis with gaps, error inf : " << error
+            << "\n";
+  assert(error < 1.0e-11);
+
+  for (auto method : {Tide::Robust::Huber, Tide::Robust::Bisquare}) {
+    fit.harmonic_analysis_robust(t, h, mask, method, ws);
+
+    long int n_before = n_allocations;
+    Eigen::internal::set_is_malloc_allowed(false);
+    std::span<const double> w =
+        fit.harmonic_analysis_robust(t, h, mask, method, ws);
+    Eigen::internal::set_is_malloc_allowed(true);
+    assert(n_allocations == n_before);
+
+    error = fit.error_inf(t, h_clean, ws);
+    std::cout << "robust harmonic_analysis, error inf : " << error
+              << ", spike weight : " << w[11] << "\n";
+    // a gap and a masked spike
+    assert(w[0] == 0.0 && w[5] == 0.0);
+    if (method == Tide::Robust::Bisquare) {
+      assert(error < 1.0e-11);
+      assert(w[11] == 0.0 && w[12] > 0.0);
+    } else {
+      assert(error < 1.0e-9);
+      assert(w[11] < 1.0e-3);
+    }
+  }
+}
+
+auto test_screen_candidates() {
+  Components components(Pulsations, Amplitudes, Phases);
+  std::vector<double> t = range(0.0, 20000.0, 20000);
+  std::vector<double> h = components.harmonic_series(t);
+
+  // fit half of the pulsations, the other half should be found in the
+  // residuals among spurious candidates
+  std::vector<double> known(Pulsations.begin(), Pulsations.begin() + 7);
+  std::vector<double> missing(Pulsations.begin() + 7, Pulsations.end());
+  std::vector<double> candidates = {0.1, 0.3, 0.45, 0.6};
+  candidates.insert(candidates.end(), missing.begin(), missing.end());
+  // unresolvable from M2 over the record
+  candidates.push_back(Pulsations.at(0) + 1.0e-5);
+
+  Components<double> fit(known);
+  fit.harmonic_analysis(t, h);
+  std::vector<Tide::Candidate<double>> shortlist =
+      fit.screen_candidates(t, h, candidates, (int)missing.size());
+
+  assert(shortlist.size() == missing.size());
+  for (const auto &c : shortlist) {
+    assert(std::find(missing.begin(), missing.end(), c.pulsation) !=
+           missing.end());
+  }
+  std::cout << "screen_candidates, best : " << shortlist.at(0).pulsation
+            << ", power : " << shortlist.at(0).power << "\n";
+}
+
+auto test_large_times() {
+  Components components(Pulsations, Amplitudes, Phases);
+
+  // a century ahead, the arguments of cos reach 5e5 rad
+  std::vector<double> t = range(876000.0, 876000.0 + 2000.0, 8000);
+  std::vector<double> h = components.harmonic_series(t);
+
+  const long double two_pi = 6.283185307179586476925286766559L;
+  double error{0};
+  for (int i = 0; i < (int)t.size(); ++i) {
+    long double h_ref{0};
+    for (int j = 0; j < (int)Pulsations.size(); ++j) {
+      long double phase =
+          std::remainder((long double)Pulsations.at(j) * t.at(i), two_pi) +
+          (long double)Phases.at(j);
+      h_ref += (long double)Amplitudes.at(j) * std::cos(phase);
+    }
+    error = std::max(error, (double)std::abs(h_ref - (long double)h.at(i)));
+  }
+  std::cout << "harmonic_series at large times, error inf : " << error << "\n";
+  assert(error < 1.0e-12);
+}
+
+auto test_harmonic_series_approx() {
+  Components components(Pulsations, Amplitudes, Phases);
+
+  std::vector<double> t = range(0.0, 20000.0, 80000);
+  std::vector<double> h = components.harmonic_series(t);
+
+  for (double tolerance : {1.0e-3, 1.0e-4}) {
+    double max_error{0};
+    std::vector<double> h_approx =
+        components.harmonic_series_approx(t, tolerance, max_error);
+
+    double error{0};
+    for (int i = 0; i < (int)t.size(); ++i) {
+      error = std::max(error, std::abs(h_approx.at(i) - h.at(i)));
+    }
+    std::cout << "harmonic_series_approx, tolerance : " << tolerance
+              << ", reported error : " << max_error
+              << ", error inf : " << error << "\n";
+    assert(max_error <= tolerance);
+    assert(error <= tolerance);
+    assert(error <= 1.5 * max_error);
+  }
+}
+
 auto main() -> int {
 
   test_harmonic_analysis();
 
   test_read_csv_data();
 
+  test_read_csv_data_error();
+
   test_read_csv_string();
 
   test_read_csv_string_units();
 
   test_setters();
+
+  test_uncertainty();
+
+  test_predict_stations();
+
+  test_read_csv_columns();
+
+  test_workspace();
+
+  test_weighted_robust();
+
+  test_screen_candidates();
+
+  test_large_times();
+
+  test_harmonic_series_approx();
   return 0;
 }
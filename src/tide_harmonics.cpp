@@ -1,16 +1,122 @@
 #include "tide_harmonics.hpp"
 #include "eigen-3.4.0/Eigen/Dense"
 #include <algorithm>
+#include <atomic>
 #include <cmath>
+#include <cstdint>
 #include <ctime>
 #include <fstream>
+#include <functional>
 #include <iomanip>
 #include <iostream>
+#include <limits>
+#include <mutex>
+#include <numeric>
+#include <random>
+#include <span>
 #include <sstream>
+#include <stdexcept>
 #include <string>
+#include <system_error>
+#include <thread>
+#include <type_traits>
 #include <vector>
 
 constexpr double PI{3.141592653589793};
+constexpr long double TWO_PI_L{6.283185307179586476925286766559L};
+
+// samples sharing a reference time for the phase reduction
+constexpr long int PHASE_BLOCK{256};
+
+template <typename T> auto wrap_phase(T phase) -> T {
+  // rounded by a cast, std::nearbyint is a library call on baseline x86-64
+  auto turns = (long int)(phase * (T)(0.5 / PI) + (phase < 0 ? -0.5 : 0.5));
+  return phase - (T)(2.0 * PI) * (T)turns;
+}
+
+template <typename T, typename F>
+void for_each_phase(T pulsation, T offset, const T *t, long int count,
+                    F &&f) {
+  /* Calls f(i, phase) with phase = pulsation * t[i] + offset in [-pi, pi].
+   * The time is re-centred on the first sample of each block, whose phase is
+   * reduced modulo 2 pi in extended precision, so that only small arguments
+   * are computed in T. The phases stay accurate and cos/sin avoid their slow
+   * range reduction however large t is. */
+
+  for (long int i0 = 0; i0 < count; i0 += PHASE_BLOCK) {
+    long int i1 = std::min(count, i0 + PHASE_BLOCK);
+    T t_ref = t[i0];
+    auto phase_ref = (T)std::remainder(
+        (long double)pulsation * (long double)t_ref + (long double)offset,
+        TWO_PI_L);
+    for (long int i = i0; i < i1; ++i) {
+      f(i, wrap_phase(phase_ref + pulsation * (t[i] - t_ref)));
+    }
+  }
+}
+
+void parallel_for(long int count, const std::function<void(long int)> &task) {
+  /* Runs task(0) ... task(count - 1) on all the available cores, the indices
+   * are handed out one by one so uneven tasks balance themselves. The first
+   * exception of a task stops the loop and is rethrown once every thread is
+   * joined. */
+
+  long int n_threads =
+      std::max(1L, (long int)std::thread::hardware_concurrency());
+  n_threads = std::min(n_threads, count);
+
+  std::atomic<long int> next{0};
+  std::mutex error_mutex;
+  std::exception_ptr error;
+  auto fail = [&](std::exception_ptr e) {
+    std::lock_guard lock(error_mutex);
+    if (!error) {
+      error = std::move(e);
+    }
+    next = count;
+  };
+  auto worker = [&]() {
+    try {
+      for (long int i = next++; i < count; i = next++) {
+        task(i);
+      }
+    } catch (...) {
+      fail(std::current_exception());
+    }
+  };
+
+  std::vector<std::thread> threads;
+  try {
+    for (long int k = 1; k < n_threads; ++k) {
+      threads.emplace_back(worker);
+    }
+  } catch (const std::system_error &) {
+    // out of threads, the ones started and this one do the work
+  }
+  worker();
+  for (auto &thread : threads) {
+    thread.join();
+  }
+  if (error) {
+    std::rethrow_exception(error);
+  }
+}
+
+template <typename T>
+using MatrixRef = Eigen::Ref<Eigen::Matrix<T, Eigen::Dynamic, Eigen::Dynamic>>;
+
+template <typename T>
+void fill_basis(const std::vector<T> &pulsations, const T *t,
+                std::type_identity_t<MatrixRef<T>> A) {
+  /* cos and sin columns of each pulsation, one row per time */
+
+  for (long int j = 0; j < (long int)pulsations.size(); ++j) {
+    for_each_phase(pulsations[j], (T)0, t, A.rows(), [&](long int i, T phase) {
+      A(i, j * 2) = std::cos(phase);
+      A(i, j * 2 + 1) = std::sin(phase);
+    });
+  }
+}
 
 template <typename T>
 auto Components<T>::build_lsq_matrix(const std::vector<T> &t)
@@ -21,18 +127,14 @@ auto Components<T>::build_lsq_matrix(const std::vector<T> &t)
   auto n = (long int)pulsations.size() * 2;
   Eigen::Matrix<T, Eigen::Dynamic, Eigen::Dynamic> A(m, n);
 
-  for (long int i = 0; i < m; ++i) {
-    for (long int j = 0; j < n / 2; ++j) {
-      A(i, j * 2) = std::cos(pulsations.at(j) * t.at(i));
-      A(i, j * 2 + 1) = std::sin(pulsations.at(j) * t.at(i));
-    }
-  }
+  fill_basis(pulsations, t.data(), A);
 
   return A;
 }
 
 template <typename T>
-auto Components<T>::extract_amplitudes(Eigen::Matrix<T, Eigen::Dynamic, 1> &X) {
+auto Components<T>::extract_amplitudes(
+    const Eigen::Ref<const Eigen::Matrix<T, Eigen::Dynamic, 1>> &X) {
 
   amplitudes.resize(X.rows() / 2);
   for (long int i = 0; i < (long int)amplitudes.size(); ++i) {
@@ -42,7 +144,8 @@ auto Components<T>::extract_amplitudes(Eigen::Matrix<T, Eigen::Dynamic, 1> &X) {
 }
 
 template <typename T>
-auto Components<T>::extract_phases(Eigen::Matrix<T, Eigen::Dynamic, 1> &X) {
+auto Components<T>::extract_phases(
+    const Eigen::Ref<const Eigen::Matrix<T, Eigen::Dynamic, 1>> &X) {
 
   phases.resize(X.rows() / 2);
 
@@ -65,14 +168,119 @@ auto Components<T>::harmonic_series(const std::vector<T> &t) -> std::vector<T> {
                                 "\n");
   }
 
-  std::vector<T> h(t.size(), 0.0);
+  std::vector<T> h(t.size());
+  Components::fill_series(t.data(), (long int)t.size(), h.data());
+  return h;
+}
 
-  for (long int i = 0; i < (long int)t.size(); ++i) {
+template <typename T>
+void Components<T>::fill_series(const T *t, long int m, T *h) {
+  /* h[i] = series at t[i], computed block by block so that the partial sums
+   * stay in cache */
+
+  std::fill(h, h + m, (T)0);
+  for (long int i0 = 0; i0 < m; i0 += PHASE_BLOCK) {
+    long int count = std::min(PHASE_BLOCK, m - i0);
     for (long int j = 0; j < (long int)pulsations.size(); ++j) {
-      h.at(i) += amplitudes.at(j) *
-                 std::cos(pulsations.at(j) * t.at(i) + phases.at(j));
+      for_each_phase(pulsations[j], phases[j], t + i0, count,
+                     [&](long int i, T phase) {
+                       h[i0 + i] += amplitudes[j] * std::cos(phase);
+                     });
     }
   }
+}
+
+template <typename T>
+void Components<T>::series_derivative(const std::vector<T> &t,
+                                      std::vector<T> &h, std::vector<T> &dh) {
+  /* harmonic series and its time derivative */
+
+  h.assign(t.size(), 0.0);
+  dh.assign(t.size(), 0.0);
+  for (long int j = 0; j < (long int)pulsations.size(); ++j) {
+    for_each_phase(pulsations[j], phases[j], t.data(), (long int)t.size(),
+                   [&](long int i, T phase) {
+                     h[i] += amplitudes[j] * std::cos(phase);
+                     dh[i] -= amplitudes[j] * pulsations[j] * std::sin(phase);
+                   });
+  }
+}
+
+template <typename T>
+auto Components<T>::harmonic_series_approx(const std::vector<T> &t,
+                                           T tolerance, T &max_error)
+    -> std::vector<T> {
+  /* Harmonic series interpolated with cubic Hermite splines between exact
+   * values and derivatives on a regular coarse grid. The interpolation error
+   * is below h^4 / 384 max|f^(4)|, the grid step h is chosen from
+   * sum(a w^4) to keep it under tolerance. max_error is the largest error
+   * measured at the middle of the grid intervals, where it peaks. Falls back
+   * to the exact series when the grid would be as dense as t. */
+
+  if (pulsations.size() != phases.size() ||
+      pulsations.size() != amplitudes.size()) {
+    throw std::invalid_argument("The components size don't match in " +
+                                std::string(__func__) + "\n");
+  }
+
+  if (pulsations.empty() || t.empty()) {
+    throw std::invalid_argument("empty components or times in " +
+                                std::string(__func__) + "\n");
+  }
+
+  if (tolerance <= 0) {
+    throw std::invalid_argument("tolerance must be positive in " +
+                                std::string(__func__) + "\n");
+  }
+
+  T d4{0};
+  for (long int j = 0; j < (long int)pulsations.size(); ++j) {
+    T w2 = pulsations[j] * pulsations[j];
+    d4 += std::abs(amplitudes[j]) * w2 * w2;
+  }
+
+  auto [t_min_it, t_max_it] = std::minmax_element(t.begin(), t.end());
+  T t0 = *t_min_it;
+  T span = *t_max_it - t0;
+  T step = d4 > 0 ? std::pow(384 * tolerance / d4, (T)0.25) : span;
+  auto n_intervals = std::max(1L, (long int)std::ceil(span / step));
+
+  max_error = 0;
+  if (span <= 0 || n_intervals * 2 + 1 >= (long int)t.size()) {
+    return harmonic_series(t);
+  }
+  step = span / (T)n_intervals;
+
+  std::vector<T> grid(n_intervals + 1);
+  std::vector<T> middles(n_intervals);
+  for (long int k = 0; k <= n_intervals; ++k) {
+    grid[k] = t0 + step * (T)k;
+  }
+  for (long int k = 0; k < n_intervals; ++k) {
+    middles[k] = t0 + step * ((T)k + 0.5);
+  }
+
+  std::vector<T> f;
+  std::vector<T> df;
+  Components::series_derivative(grid, f, df);
+
+  // Hermite value at the middle : (f0 + f1) / 2 + h (f0' - f1') / 8
+  std::vector<T> f_middles = harmonic_series(middles);
+  for (long int k = 0; k < n_intervals; ++k) {
+    T p = (f[k] + f[k + 1]) * 0.5 + step * (df[k] - df[k + 1]) * 0.125;
+    max_error = std::max(max_error, std::abs(p - f_middles[k]));
+  }
+
+  T inv_step = 1 / step;
+  std::vector<T> h(t.size());
+  for (long int i = 0; i < (long int)t.size(); ++i) {
+    auto k = std::min(n_intervals - 1, (long int)((t[i] - t0) * inv_step));
+    T s = (t[i] - grid[k]) * inv_step;
+    T s2 = s * s;
+    T s3 = s2 * s;
+    h[i] = (2 * s3 - 3 * s2 + 1) * f[k] + (s3 - 2 * s2 + s) * step * df[k] +
+           (-2 * s3 + 3 * s2) * f[k + 1] + (s3 - s2) * step * df[k + 1];
+  }
   return h;
 }
 
@@ -115,6 +323,684 @@ void Components<T>::harmonic_analysis(const std::vector<T> &times,
   Components::extract_phases(X);
 }
 
+template <typename T>
+void Components<T>::check_workspace(long int m, const Workspace<T> &ws) {
+  if (m > ws.max_samples || (long int)pulsations.size() > ws.max_pulsations) {
+    throw std::invalid_argument("workspace too small in " +
+                                std::string(__func__) + "\n");
+  }
+}
+
+template <typename T>
+void Components<T>::harmonic_analysis(std::span<const T> times,
+                                      std::span<const T> heights,
+                                      Workspace<T> &ws) {
+  /* Same fit as harmonic_analysis, solved in the workspace buffers so that
+   * repeated fits don't allocate. */
+
+  if (times.size() != heights.size()) {
+    throw std::invalid_argument("vectors sizes don't match in " +
+                                std::string(__func__) + "\n");
+  }
+
+  if (pulsations.empty()) {
+    throw std::invalid_argument("Pulsation vector is empty in " +
+                                std::string(__func__) + "\n");
+  }
+
+  auto m = (long int)times.size();
+  auto n = (long int)pulsations.size() * 2;
+  Components::check_workspace(m, ws);
+
+  auto A = ws.A.topLeftCorner(m, n);
+  fill_basis(pulsations, times.data(), A);
+
+  Components::solve_least_squares(m, heights.data(), nullptr, ws);
+}
+
+template <typename T>
+void Components<T>::solve_least_squares(long int m, const T *heights,
+                                        const T *weights, Workspace<T> &ws) {
+  /* Least squares solution for the basis stored in ws.A, weighted if weights
+   * isn't null, in which case NaN heights or weights count as weight 0.
+   * A is reduced to its triangular factor R by Householder reflections, one
+   * block of rows at a time, then the SVD of R gives the same solution as the
+   * SVD of A, rank deficient fits included. */
+
+  auto n = (long int)pulsations.size() * 2;
+  auto A = ws.A.topLeftCorner(m, n);
+
+  // R is padded with zeros to the workspace size, which only adds zero
+  // singular values but keeps the SVD buffers from being resized
+  ws.r_factor.setZero();
+  ws.qt_heights.setZero();
+  auto R = ws.r_factor.topLeftCorner(n, n);
+  auto z = ws.qt_heights.head(n);
+
+  const long int block = Workspace<T>::block;
+  for (long int i0 = 0; i0 < m; i0 += block) {
+    long int count = std::min(block, m - i0);
+
+    // rows and heights scaled by sqrt(w), which gives the weighted fit
+    auto rows = ws.block_rows.topLeftCorner(count, n);
+    auto h = ws.block_heights.head(count);
+    for (long int i = 0; i < count; ++i) {
+      T s{1};
+      if (weights != nullptr) {
+        T w = weights[i0 + i];
+        s = (std::isnan(w) || std::isnan(heights[i0 + i]) || w <= 0)
+                ? 0
+                : std::sqrt(w);
+      }
+      rows.row(i) = s * A.row(i0 + i);
+      h(i) = s == 0 ? 0 : s * heights[i0 + i];
+    }
+
+    // [R; rows] brought back to triangular, column k is reflected onto R(k, k)
+    for (long int k = 0; k < n; ++k) {
+      T sigma = rows.col(k).squaredNorm();
+      if (sigma == 0) {
+        continue;
+      }
+      T alpha = R(k, k);
+      T norm = std::sqrt(alpha * alpha + sigma);
+      T beta = alpha <= 0 ? norm : -norm;
+      T tau = (beta - alpha) / beta;
+      R(k, k) = beta;
+
+      // the reflection I - tau v v^T, v = [1; rows.col(k)]
+      rows.col(k) /= alpha - beta;
+      long int rest = n - k - 1;
+      auto dots = ws.column_dots.head(rest);
+      dots.noalias() = rows.rightCols(rest).transpose() * rows.col(k);
+      dots += R.row(k).tail(rest).transpose();
+      dots *= tau;
+      R.row(k).tail(rest) -= dots.transpose();
+      rows.rightCols(rest).noalias() -= rows.col(k) * dots.transpose();
+
+      T dot = tau * (z(k) + rows.col(k).dot(h));
+      z(k) -= dot;
+      h -= dot * rows.col(k);
+    }
+  }
+
+  // singular values cut as in the Eigen solvers, relative to the largest one
+  ws.svd.compute(ws.r_factor);
+  const auto &singular = ws.svd.singularValues();
+  T threshold =
+      std::max(singular(0) * (T)std::max(1L, std::min(m, n)) *
+                   std::numeric_limits<T>::epsilon(),
+               std::numeric_limits<T>::min());
+  ws.projected.noalias() = ws.svd.matrixU().transpose() * ws.qt_heights;
+  for (long int k = 0; k < ws.projected.size(); ++k) {
+    ws.projected(k) =
+        singular(k) > threshold ? ws.projected(k) / singular(k) : 0;
+  }
+  ws.coefficients.noalias() = ws.svd.matrixV() * ws.projected;
+
+  auto X = ws.coefficients.head(n);
+  Components::extract_amplitudes(X);
+  Components::extract_phases(X);
+}
+
+template <typename T>
+void Components<T>::harmonic_analysis(const std::vector<T> &times,
+                                      const std::vector<T> &heights,
+                                      const std::vector<T> &weights) {
+  Workspace<T> ws((long int)times.size(), (long int)pulsations.size());
+  harmonic_analysis(times, heights, weights, ws);
+}
+
+template <typename T>
+void Components<T>::harmonic_analysis(std::span<const T> times,
+                                      std::span<const T> heights,
+                                      std::span<const T> weights,
+                                      Workspace<T> &ws) {
+  /* Weighted least squares, a weight of 0 or a NaN height masks the sample
+   * without removing it from the vectors. */
+
+  if (times.size() != heights.size() || times.size() != weights.size()) {
+    throw std::invalid_argument("vectors sizes don't match in " +
+                                std::string(__func__) + "\n");
+  }
+
+  if (pulsations.empty()) {
+    throw std::invalid_argument("Pulsation vector is empty in " +
+                                std::string(__func__) + "\n");
+  }
+
+  auto m = (long int)times.size();
+  Components::check_workspace(m, ws);
+
+  fill_basis(pulsations, times.data(),
+             ws.A.topLeftCorner(m, (long int)pulsations.size() * 2));
+  Components::solve_least_squares(m, heights.data(), weights.data(), ws);
+}
+
+template <typename T>
+auto Components<T>::harmonic_analysis_robust(
+    std::span<const T> times, std::span<const T> heights,
+    std::span<const T> weights, Tide::Robust method, Workspace<T> &ws,
+    int max_iterations) -> std::span<const T> {
+  /* Iteratively reweighted least squares. The residuals are scaled by their
+   * median absolute deviation, the robust weights multiply the given ones
+   * (all 1 if weights is empty). Returns the final weights, kept in the
+   * workspace; spikes end up with a small or zero weight. */
+
+  if (times.size() != heights.size() ||
+      (!weights.empty() && times.size() != weights.size())) {
+    throw std::invalid_argument("vectors sizes don't match in " +
+                                std::string(__func__) + "\n");
+  }
+
+  if (pulsations.empty()) {
+    throw std::invalid_argument("Pulsation vector is empty in " +
+                                std::string(__func__) + "\n");
+  }
+
+  auto m = (long int)times.size();
+  auto n = (long int)pulsations.size() * 2;
+  Components::check_workspace(m, ws);
+
+  auto A = ws.A.topLeftCorner(m, n);
+  fill_basis(pulsations, times.data(), A);
+
+  auto prior = [&](long int i) -> T {
+    T w = weights.empty() ? 1 : weights[i];
+    return (std::isnan(w) || std::isnan(heights[i]) || w <= 0) ? 0 : w;
+  };
+
+  std::span<T> w(ws.weights.data(), m);
+  for (long int i = 0; i < m; ++i) {
+    w[i] = prior(i);
+  }
+  Components::solve_least_squares(m, heights.data(), w.data(), ws);
+
+  const T c = method == Tide::Robust::Huber ? 1.345 : 4.685;
+  auto X = ws.coefficients.head(n);
+  auto previous = ws.previous.head(n);
+  Eigen::Map<Eigen::Matrix<T, Eigen::Dynamic, 1>> r(ws.series.data(), m);
+
+  for (int iteration = 0; iteration < max_iterations; ++iteration) {
+    r.noalias() = A * X;
+    long int n_used = 0;
+    for (long int i = 0; i < m; ++i) {
+      r(i) = heights[i] - r(i);
+      if (prior(i) > 0) {
+        w[n_used++] = std::abs(r(i));
+      }
+    }
+    if (n_used == 0) {
+      break;
+    }
+
+    // w is free until the new weights are computed, holds |r| for the median
+    std::nth_element(w.begin(), w.begin() + n_used / 2, w.begin() + n_used);
+    T scale = w[n_used / 2] / 0.6745;
+    if (scale <= 0) {
+      // exact fit of more than half of the samples, refitted on those only
+      for (long int i = 0; i < m; ++i) {
+        w[i] = r(i) == 0 ? prior(i) : 0;
+      }
+      Components::solve_least_squares(m, heights.data(), w.data(), ws);
+      break;
+    }
+
+    for (long int i = 0; i < m; ++i) {
+      // masked samples, their residual may be NaN
+      if (prior(i) == 0) {
+        w[i] = 0;
+        continue;
+      }
+      T u = std::abs(r(i)) / (c * scale);
+      T psi{0};
+      if (method == Tide::Robust::Huber) {
+        psi = u <= 1 ? 1 : 1 / u;
+      } else {
+        psi = u < 1 ? (1 - u * u) * (1 - u * u) : 0;
+      }
+      w[i] = prior(i) * psi;
+    }
+
+    previous = X;
+    Components::solve_least_squares(m, heights.data(), w.data(), ws);
+    if ((X - previous).norm() <= 1.0e-12 * X.norm()) {
+      break;
+    }
+  }
+
+  return w;
+}
+
+template <typename T>
+auto Components<T>::harmonic_series(std::span<const T> t, Workspace<T> &ws)
+    -> std::span<const T> {
+  /* The series is written in the workspace, valid until its next use */
+
+  if (pulsations.size() != phases.size() ||
+      pulsations.size() != amplitudes.size()) {
+    throw std::invalid_argument("The components size don't match in " +
+                                std::string(__func__) + "\n");
+  }
+
+  if (pulsations.empty()) {
+    throw std::invalid_argument("empty components in " + std::string(__func__) +
+                                "\n");
+  }
+
+  Components::check_workspace((long int)t.size(), ws);
+
+  Components::fill_series(t.data(), (long int)t.size(), ws.series.data());
+  return {ws.series.data(), t.size()};
+}
+
+template <typename T>
+auto Components<T>::harmonic_analysis_columns(
+    const std::vector<T> &times,
+    const Eigen::Matrix<T, Eigen::Dynamic, Eigen::Dynamic> &heights)
+    -> std::vector<Components<T>> {
+  /* Fits every column of heights against the same times, returns one set of
+   * components per column. NaN heights, missing values of the readers, are
+   * left out of the fit of their column; the columns sharing the same valid
+   * rows share a single factorisation. */
+
+  if ((long int)times.size() != heights.rows()) {
+    throw std::invalid_argument("vectors sizes don't match in " +
+                                std::string(__func__) + "\n");
+  }
+
+  if (pulsations.empty()) {
+    throw std::invalid_argument("Pulsation vector is empty in " +
+                                std::string(__func__) + "\n");
+  }
+
+  Eigen::Matrix<T, Eigen::Dynamic, Eigen::Dynamic> A =
+      Components::build_lsq_matrix(times);
+
+  // columns grouped by their valid rows, one factorisation per group
+  std::map<std::vector<bool>, std::vector<long int>> groups;
+  for (long int c = 0; c < heights.cols(); ++c) {
+    std::vector<bool> valid(heights.rows());
+    for (long int i = 0; i < heights.rows(); ++i) {
+      valid[i] = !std::isnan(heights(i, c));
+    }
+    if (std::find(valid.begin(), valid.end(), true) == valid.end()) {
+      throw std::invalid_argument("no valid height in column " +
+                                  std::to_string(c) + " in " +
+                                  std::string(__func__) + "\n");
+    }
+    groups[valid].push_back(c);
+  }
+
+  Eigen::Matrix<T, Eigen::Dynamic, Eigen::Dynamic> X(A.cols(), heights.cols());
+  for (const auto &[valid, cols] : groups) {
+    std::vector<long int> rows;
+    for (long int i = 0; i < heights.rows(); ++i) {
+      if (valid[i]) {
+        rows.push_back(i);
+      }
+    }
+    Eigen::Matrix<T, Eigen::Dynamic, Eigen::Dynamic> H_g = heights(rows, cols);
+    if ((long int)rows.size() == A.rows()) {
+      X(Eigen::all, cols) =
+          A.bdcSvd(Eigen::ComputeThinU | Eigen::ComputeThinV).solve(H_g);
+      continue;
+    }
+    Eigen::Matrix<T, Eigen::Dynamic, Eigen::Dynamic> A_g = A(rows, Eigen::all);
+    X(Eigen::all, cols) =
+        A_g.bdcSvd(Eigen::ComputeThinU | Eigen::ComputeThinV).solve(H_g);
+  }
+
+  std::vector<Components<T>> columns(X.cols(), Components(pulsations));
+  for (long int c = 0; c < X.cols(); ++c) {
+    columns[c].extract_amplitudes(X.col(c));
+    columns[c].extract_phases(X.col(c));
+  }
+  return columns;
+}
+
+template <typename T>
+auto Tide::station_coefficients(const std::vector<Components<T>> &stations)
+    -> Eigen::Matrix<T, Eigen::Dynamic, Eigen::Dynamic> {
+  /* cos and sin coefficients of each station in columns, the stations must
+   * share the same pulsations. */
+
+  if (stations.empty()) {
+    throw std::invalid_argument("empty stations in " + std::string(__func__) +
+                                "\n");
+  }
+
+  auto n = (long int)stations.front().pulsations.size();
+  Eigen::Matrix<T, Eigen::Dynamic, Eigen::Dynamic> C(n * 2,
+                                                     (long int)stations.size());
+
+  for (long int s = 0; s < (long int)stations.size(); ++s) {
+    const auto &station = stations[s];
+    if ((long int)station.pulsations.size() != n ||
+        (long int)station.amplitudes.size() != n ||
+        (long int)station.phases.size() != n) {
+      throw std::invalid_argument("The components size don't match in " +
+                                  std::string(__func__) + "\n");
+    }
+    // a cos(w t + p) = a cos(p) cos(w t) - a sin(p) sin(w t)
+    for (long int j = 0; j < n; ++j) {
+      C(j * 2, s) = station.amplitudes[j] * std::cos(station.phases[j]);
+      C(j * 2 + 1, s) = -station.amplitudes[j] * std::sin(station.phases[j]);
+    }
+  }
+  return C;
+}
+
+template <typename T>
+auto Tide::predict_stations(
+    const std::vector<T> &pulsations,
+    const Eigen::Matrix<T, Eigen::Dynamic, Eigen::Dynamic> &coefficients,
+    const std::vector<T> &times, Layout layout)
+    -> Eigen::Matrix<T, Eigen::Dynamic, Eigen::Dynamic> {
+  /* Harmonic series of many stations on a shared time axis. The cos/sin basis
+   * is built once per block of times and multiplied by the coefficients of
+   * all the stations at once, instead of recomputing it for each station. */
+
+  using Matrix = Eigen::Matrix<T, Eigen::Dynamic, Eigen::Dynamic>;
+
+  if (pulsations.empty()) {
+    throw std::invalid_argument("Pulsation vector is empty in " +
+                                std::string(__func__) + "\n");
+  }
+
+  if (coefficients.rows() != (long int)pulsations.size() * 2) {
+    throw std::invalid_argument("coefficients rows don't match in " +
+                                std::string(__func__) + "\n");
+  }
+
+  auto m = (long int)times.size();
+  auto n = coefficients.rows();
+  auto n_stations = coefficients.cols();
+
+  Matrix out = layout == Layout::TimeMajor ? Matrix(m, n_stations)
+                                           : Matrix(n_stations, m);
+
+  // small enough for the basis block to stay in cache
+  const long int block = 256;
+  const long int n_blocks = (m + block - 1) / block;
+
+  parallel_for(n_blocks, [&](long int b) {
+    long int i0 = b * block;
+    long int count = std::min(block, m - i0);
+    Matrix B(count, n);
+    fill_basis(pulsations, times.data() + i0, B);
+
+    if (layout == Layout::TimeMajor) {
+      out.middleRows(i0, count).noalias() = B * coefficients;
+    } else {
+      out.middleCols(i0, count).noalias() =
+          coefficients.transpose() * B.transpose();
+    }
+  });
+
+  return out;
+}
+
+template <typename T>
+auto Components<T>::uncertainty(const std::vector<T> &times,
+                                const std::vector<T> &heights, int replicates,
+                                Tide::Resampling method, T confidence,
+                                unsigned int seed) -> Tide::Uncertainty<T> {
+  /* Fits the components, then refits `replicates` perturbed copies of the
+   * signal to get percentile confidence intervals. The matrix is factorised
+   * once and only the right hand side changes between replicates, so each one
+   * costs a matrix product instead of a full fit. */
+
+  if (times.size() != heights.size()) {
+    throw std::invalid_argument("vectors sizes don't match in " +
+                                std::string(__func__) + "\n");
+  }
+
+  if (pulsations.empty()) {
+    throw std::invalid_argument("Pulsation vector is empty in " +
+                                std::string(__func__) + "\n");
+  }
+
+  if (replicates < 2 || confidence <= 0.0 || confidence >= 1.0) {
+    throw std::invalid_argument("invalid replicates or confidence in " +
+                                std::string(__func__) + "\n");
+  }
+
+  using Matrix = Eigen::Matrix<T, Eigen::Dynamic, Eigen::Dynamic>;
+  using Vector = Eigen::Matrix<T, Eigen::Dynamic, 1>;
+
+  Matrix A = Components::build_lsq_matrix(times);
+  auto m = A.rows();
+  auto n = A.cols();
+  Eigen::Map<const Vector> h(heights.data(), m);
+
+  Eigen::BDCSVD<Matrix> svd(A, Eigen::ComputeThinU | Eigen::ComputeThinV);
+  auto rank = svd.rank();
+
+  // V S^-1, a replicate solution is X0 + V S^-1 U^T e for a perturbation e
+  Vector s_inv = Vector::Zero(n);
+  for (long int k = 0; k < rank; ++k) {
+    s_inv(k) = 1.0 / svd.singularValues()(k);
+  }
+  Matrix VS = svd.matrixV() * s_inv.asDiagonal();
+
+  Vector X0 = VS * (svd.matrixU().transpose() * h);
+  Components::extract_amplitudes(X0);
+  Components::extract_phases(X0);
+
+  // centred, without a constant column in A a mean left in the residuals
+  // would bias every bootstrap replicate by the same amount
+  Vector residuals = h - A * X0;
+  residuals.array() -= residuals.mean();
+  auto dof = (T)std::max(1L, (long int)(m - rank));
+  T sigma = std::sqrt(residuals.squaredNorm() / dof);
+  // residuals are smaller than the noise they estimate by sqrt((m - rank) / m)
+  residuals *= std::sqrt((T)m / dof);
+
+  Matrix P;
+  if (method == Tide::Resampling::ResidualBootstrap) {
+    P = VS * svd.matrixU().transpose();
+  }
+
+  const long int n_comp = n / 2;
+  const long int batch = 64;
+  const long int n_batches = (replicates + batch - 1) / batch;
+
+  // replicate r of constituent j is stored at [j * replicates + r]
+  std::vector<T> amp((std::size_t)(n_comp * replicates));
+  std::vector<T> dphi((std::size_t)(n_comp * replicates));
+
+  parallel_for(n_batches, [&](long int b) {
+    // seeded per batch so the draws don't depend on the number of threads
+    std::seed_seq seq{seed, (unsigned int)b};
+    std::mt19937_64 gen(seq);
+
+    long int r0 = b * batch;
+    long int count = std::min(batch, (long int)replicates - r0);
+    Matrix D(n, count);
+
+    if (method == Tide::Resampling::ResidualBootstrap) {
+      // P e accumulated draw by draw, the resampled residuals e are never
+      // stored. Two indices per draw, scaled by multiplication instead of the
+      // rejection loop of uniform_int_distribution, the bias is ~m / 2^32
+      auto size = (std::uint64_t)m;
+      auto draw = [&](std::uint64_t bits) {
+        return residuals((long int)((bits * size) >> 32));
+      };
+      D.setZero();
+      for (long int c = 0; c < count; ++c) {
+        auto d = D.col(c);
+        for (long int i = 0; i < m; i += 2) {
+          std::uint64_t r = gen();
+          d.noalias() += draw(r & 0xffffffffU) * P.col(i);
+          if (i + 1 < m) {
+            d.noalias() += draw(r >> 32) * P.col(i + 1);
+          }
+        }
+      }
+    } else {
+      // U^T e of a white noise e is itself white, no need to draw m samples
+      std::normal_distribution<T> normal(0.0, sigma);
+      Matrix Z(n, count);
+      for (long int c = 0; c < count; ++c) {
+        for (long int k = 0; k < n; ++k) {
+          Z(k, c) = normal(gen);
+        }
+      }
+      D.noalias() = VS * Z;
+    }
+
+    for (long int c = 0; c < count; ++c) {
+      for (long int j = 0; j < n_comp; ++j) {
+        T xc = X0(j * 2) + D(j * 2, c);
+        T xs = X0(j * 2 + 1) + D(j * 2 + 1, c);
+        auto k = (std::size_t)(j * replicates + r0 + c);
+        amp[k] = std::sqrt(xc * xc + xs * xs);
+        dphi[k] = std::remainder(std::atan2(xc, xs) - (T)PI * 0.5 - phases[j],
+                                 (T)(2.0 * PI));
+      }
+    }
+  });
+
+  auto i_low =
+      (long int)std::floor((1.0 - confidence) * 0.5 * (replicates - 1));
+  auto i_high =
+      (long int)std::ceil((1.0 + confidence) * 0.5 * (replicates - 1));
+
+  auto std_dev = [](auto first, auto last, T center) {
+    T s{0};
+    for (auto it = first; it != last; ++it) {
+      s += (*it - center) * (*it - center);
+    }
+    return std::sqrt(s / (T)(std::distance(first, last) - 1));
+  };
+
+  Tide::Uncertainty<T> result;
+  for (long int j = 0; j < n_comp; ++j) {
+    auto first_a = amp.begin() + j * replicates;
+    auto first_p = dphi.begin() + j * replicates;
+    auto last_a = first_a + replicates;
+    auto last_p = first_p + replicates;
+
+    T amp_mean = std::accumulate(first_a, last_a, (T)0) / (T)replicates;
+    result.amplitudes_std.push_back(std_dev(first_a, last_a, amp_mean));
+    result.phases_std.push_back(std_dev(first_p, last_p, (T)0));
+
+    std::sort(first_a, last_a);
+    std::sort(first_p, last_p);
+    result.amplitudes_low.push_back(*(first_a + i_low));
+    result.amplitudes_high.push_back(*(first_a + i_high));
+    result.phases_low.push_back(phases[j] + *(first_p + i_low));
+    result.phases_high.push_back(phases[j] + *(first_p + i_high));
+  }
+
+  return result;
+}
+
+template <typename T>
+auto Components<T>::screen_candidates(const std::vector<T> &times,
+                                      const std::vector<T> &heights,
+                                      const std::vector<T> &candidates,
+                                      int max_count)
+    -> std::vector<Tide::Candidate<T>> {
+  /* Lomb-Scargle power of the residuals at each candidate pulsation, the
+   * residuals being the heights minus the current components if they are
+   * set. Returns at most max_count candidates by decreasing power, skipping
+   * those closer than the Rayleigh resolution 2 pi / record length to the
+   * current pulsations or to a better candidate. Each candidate costs one
+   * pass over the samples instead of a full fit. NaN heights are ignored. */
+
+  if (times.size() != heights.size()) {
+    throw std::invalid_argument("vectors sizes don't match in " +
+                                std::string(__func__) + "\n");
+  }
+
+  std::vector<T> r = heights;
+  if (!pulsations.empty() && amplitudes.size() == pulsations.size() &&
+      phases.size() == pulsations.size()) {
+    std::vector<T> h_fit = harmonic_series(times);
+    for (long int i = 0; i < (long int)r.size(); ++i) {
+      r[i] -= h_fit[i];
+    }
+  }
+
+  T r2{0};
+  T t_min = std::numeric_limits<T>::max();
+  T t_max = std::numeric_limits<T>::lowest();
+  for (long int i = 0; i < (long int)r.size(); ++i) {
+    if (!std::isnan(r[i])) {
+      r2 += r[i] * r[i];
+      t_min = std::min(t_min, times[i]);
+      t_max = std::max(t_max, times[i]);
+    }
+  }
+  if (r2 <= 0 || t_max <= t_min) {
+    return {};
+  }
+
+  std::vector<Tide::Candidate<T>> ranked(candidates.size());
+  parallel_for((long int)candidates.size(), [&](long int k) {
+    T w = candidates[k];
+    T cc{0};
+    T ss{0};
+    T cs{0};
+    T yc{0};
+    T ys{0};
+    for_each_phase(w, (T)0, times.data(), (long int)r.size(),
+                   [&](long int i, T phase) {
+                     if (std::isnan(r[i])) {
+                       return;
+                     }
+                     T c = std::cos(phase);
+                     T s = std::sin(phase);
+                     cc += c * c;
+                     ss += s * s;
+                     cs += c * s;
+                     yc += r[i] * c;
+                     ys += r[i] * s;
+                   });
+
+    // variance explained by the least squares fit of a cos and a sin
+    T det = cc * ss - cs * cs;
+    T power{0};
+    if (det > 1.0e-10 * cc * ss) {
+      power = (ss * yc * yc - 2 * cs * yc * ys + cc * ys * ys) / det;
+    } else if (cc > 0) {
+      power = yc * yc / cc;
+    }
+    ranked[k] = {k, w, power / r2};
+  });
+
+  std::sort(ranked.begin(), ranked.end(), [](const auto &a, const auto &b) {
+    return a.power > b.power;
+  });
+
+  const T resolution = (T)(2.0 * PI) / (t_max - t_min);
+  auto resolved = [&](T w, T other) {
+    return std::abs(w - other) >= resolution;
+  };
+
+  std::vector<Tide::Candidate<T>> shortlist;
+  for (const auto &candidate : ranked) {
+    if ((int)shortlist.size() >= max_count) {
+      break;
+    }
+    bool keep = std::all_of(pulsations.begin(), pulsations.end(), [&](T w) {
+      return resolved(candidate.pulsation, w);
+    });
+    keep = keep && std::all_of(shortlist.begin(), shortlist.end(),
+                               [&](const auto &c) {
+                                 return resolved(candidate.pulsation,
+                                                 c.pulsation);
+                               });
+    if (keep) {
+      shortlist.push_back(candidate);
+    }
+  }
+
+  return shortlist;
+}
+
 template <typename T>
 void Components<T>::set_pulsations(const std::vector<T> &pulsations_in) {
   pulsations = pulsations_in;
@@ -218,6 +1104,54 @@ auto Components<T>::error_2(const std::vector<T> &t,
   return error;
 }
 
+template <typename T>
+auto Components<T>::error_inf(std::span<const T> t, std::span<const T> h,
+                              Workspace<T> &ws) -> T {
+  if (t.size() != h.size()) {
+    throw std::invalid_argument("vectors sizes don't match in " +
+                                std::string(__func__) + "\n");
+  }
+  std::span<const T> h_fit = harmonic_series(t, ws);
+  T error{0};
+  for (long int i = 0; i < (long int)h.size(); ++i) {
+    error = std::max(error, std::abs(h_fit[i] - h[i]));
+  }
+
+  return error;
+}
+
+template <typename T>
+auto Components<T>::error_mean(std::span<const T> t, std::span<const T> h,
+                               Workspace<T> &ws) -> T {
+  if (t.size() != h.size()) {
+    throw std::invalid_argument("vectors sizes don't match in " +
+                                std::string(__func__) + "\n");
+  }
+  std::span<const T> h_fit = harmonic_series(t, ws);
+  T error{0};
+  for (long int i = 0; i < (long int)h.size(); ++i) {
+    error += std::abs(h_fit[i] - h[i]);
+  }
+
+  return error / (T)h.size();
+}
+
+template <typename T>
+auto Components<T>::error_2(std::span<const T> t, std::span<const T> h,
+                            Workspace<T> &ws) -> T {
+  if (t.size() != h.size()) {
+    throw std::invalid_argument("vectors sizes don't match in " +
+                                std::string(__func__) + "\n");
+  }
+  std::span<const T> h_fit = harmonic_series(t, ws);
+  T error{0};
+  for (long int i = 0; i < (long int)h.size(); ++i) {
+    error += (h_fit[i] - h[i]) * (h_fit[i] - h[i]);
+  }
+
+  return error;
+}
+
 auto get_column(std::stringstream &ss, std::string &token, char sep,
                 int col) -> bool {
   ss.clear();
@@ -284,7 +1218,7 @@ void read_csv_string(const std::string &csv, const char *format, char sep,
   }
 }
 
-auto valid_float(std::string &str, double *value) -> bool {
+auto valid_float(const std::string &str, double *value) -> bool {
   try {
     *value = std::stod(str);
   } catch (const std::exception &) {
@@ -320,6 +1254,109 @@ void read_csv_string_units(const std::string &csv, char sep, int col_t,
   datetime_str = std::to_string(time.at(0));
 }
 
+void split_line(const std::string &line, char sep,
+                std::vector<std::string> &tokens) {
+  /* tokens keeps its strings between lines to avoid reallocating them */
+  std::size_t n_tokens = 0;
+  std::size_t start = 0;
+  while (true) {
+    std::size_t end = line.find(sep, start);
+    if (n_tokens == tokens.size()) {
+      tokens.emplace_back();
+    }
+    tokens[n_tokens++].assign(line, start,
+                              end == std::string::npos ? end : end - start);
+    if (end == std::string::npos) {
+      break;
+    }
+    start = end + 1;
+  }
+  tokens.resize(n_tokens);
+}
+
+void read_csv_columns(
+    const std::string &csv, char sep, int col_t, const std::vector<int> &cols_h,
+    const std::function<bool(const std::string &, double &)> &parse_time,
+    std::vector<double> &time,
+    Eigen::Matrix<double, Eigen::Dynamic, Eigen::Dynamic> &values) {
+  /* Reads all the value columns in a single pass, lines without a valid time
+   * are skipped and missing or invalid values are set to NaN. */
+
+  time.resize(0);
+  std::vector<double> rows; // row major, one row per time
+  std::stringstream csv_stream(csv);
+  std::string line;
+  std::vector<std::string> tokens;
+  double t_val{0};
+  double val{0};
+
+  while (getline(csv_stream, line)) {
+    split_line(line, sep, tokens);
+    if (col_t >= (int)tokens.size() || !parse_time(tokens[col_t], t_val)) {
+      continue;
+    }
+    time.push_back(t_val);
+    for (int col : cols_h) {
+      if (col < (int)tokens.size() && valid_float(tokens[col], &val)) {
+        rows.push_back(val);
+      } else {
+        rows.push_back(std::nan(""));
+      }
+    }
+  }
+
+  values = Eigen::Map<const Eigen::Matrix<double, Eigen::Dynamic,
+                                          Eigen::Dynamic, Eigen::RowMajor>>(
+      rows.data(), (long int)time.size(), (long int)cols_h.size());
+}
+
+void read_csv_string(
+    const std::string &csv, const char *format, char sep, int col_t,
+    const std::vector<int> &cols_h, std::vector<double> &time,
+    Eigen::Matrix<double, Eigen::Dynamic, Eigen::Dynamic> &values,
+    std::string &datetime_str) {
+
+  std::tm t = {};
+  std::time_t timestamp_t0{0};
+  bool first = true;
+
+  auto parse_time = [&](const std::string &token, double &hours) {
+    std::stringstream datetime_string(token);
+    datetime_string >> std::get_time(&t, format);
+    if (datetime_string.fail()) {
+      return false;
+    }
+    if (first) {
+      datetime_str = token;
+      timestamp_t0 = std::mktime(&t);
+      first = false;
+    }
+    hours = (double)(std::mktime(&t) - timestamp_t0) / 3600.0;
+    return true;
+  };
+
+  read_csv_columns(csv, sep, col_t, cols_h, parse_time, time, values);
+}
+
+void read_csv_string_units(
+    const std::string &csv, char sep, int col_t, const std::vector<int> &cols_h,
+    double units, std::vector<double> &time,
+    Eigen::Matrix<double, Eigen::Dynamic, Eigen::Dynamic> &values,
+    std::string &datetime_str) {
+
+  auto parse_time = [&](const std::string &token, double &hours) {
+    double val{0};
+    if (!valid_float(token, &val)) {
+      return false;
+    }
+    hours = units * val / 3600.0;
+    return true;
+  };
+
+  read_csv_columns(csv, sep, col_t, cols_h, parse_time, time, values);
+  datetime_str = std::to_string(time.at(0));
+}
+
 void read_csv_data(std::string fname, std::vector<double> &time,
                    std::vector<double> &value) {
 
@@ -329,8 +1366,7 @@ void read_csv_data(std::string fname, std::vector<double> &time,
 
   file.open(fname, std::ios::in);
   if (file.fail()) {
-    std::cout << "Error, can't open : " << fname << "\n";
-    exit(1);
+    throw std::runtime_error("can't open : " + fname + "\n");
   }
 
   const char *format = "%d/%m/%Y %H:%M:%S";
@@ -342,8 +1378,7 @@ void read_csv_data(std::string fname, std::vector<double> &time,
 
   while (line.starts_with("#")) {
     if (!getline(file, line)) {
-      std::cout << "Error, cannot read : " << fname << "\n";
-      exit(1);
+      throw std::runtime_error("cannot read : " + fname + "\n");
     }
   }
 
@@ -353,12 +1388,21 @@ void read_csv_data(std::string fname, std::vector<double> &time,
     if (getline(ss, token, ';')) {
       std::stringstream datetime_string(token);
       datetime_string >> std::get_time(&t, format);
+      if (datetime_string.fail()) {
+        throw std::runtime_error("invalid date \"" + token + "\" in : " +
+                                 fname + "\n");
+      }
       timestamp_t0 = std::mktime(&t);
       time.push_back(0.0);
     }
 
     if (getline(ss, token, ';')) {
-      value.push_back(std::stod(token));
+      double val{0};
+      if (!valid_float(token, &val)) {
+        throw std::runtime_error("invalid value \"" + token + "\" in : " +
+                                 fname + "\n");
+      }
+      value.push_back(val);
     }
   }
 
@@ -369,12 +1413,21 @@ void read_csv_data(std::string fname, std::vector<double> &time,
     if (getline(ss, token, ';')) {
       std::stringstream datetime_string(token);
       datetime_string >> std::get_time(&t, format);
+      if (datetime_string.fail()) {
+        throw std::runtime_error("invalid date \"" + token + "\" in : " +
+                                 fname + "\n");
+      }
       timestamp = std::mktime(&t) - timestamp_t0;
       time.push_back((double)timestamp / 3600.0);
     }
 
     if (getline(ss, token, ';')) {
-      value.push_back(std::stod(token));
+      double val{0};
+      if (!valid_float(token, &val)) {
+        throw std::runtime_error("invalid value \"" + token + "\" in : " +
+                                 fname + "\n");
+      }
+      value.push_back(val);
     }
   }
   file.close();
@@ -390,3 +1443,11 @@ void Tide::get_constituants_const(std::vector<std::string> &names,
 
 template class Components<double>;
 template double Tide::mean(std::vector<double> &v);
+template auto
+Tide::station_coefficients(const std::vector<Components<double>> &stations)
+    -> Eigen::Matrix<double, Eigen::Dynamic, Eigen::Dynamic>;
+template auto Tide::predict_stations(
+    const std::vector<double> &pulsations,
+    const Eigen::Matrix<double, Eigen::Dynamic, Eigen::Dynamic> &coefficients,
+    const std::vector<double> &times, Layout layout)
+    -> Eigen::Matrix<double, Eigen::Dynamic, Eigen::Dynamic>;
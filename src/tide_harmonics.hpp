@@ -3,9 +3,80 @@
 
 #include "eigen-3.4.0/Eigen/Dense"
 #include <map>
+#include <span>
 #include <string>
 #include <vector>
 
+namespace Tide {
+
+enum class Robust {
+  Huber,    // down-weights residuals beyond 1.345 robust deviations
+  Bisquare, // Tukey's biweight, rejects residuals beyond 4.685 deviations
+};
+
+enum class Resampling {
+  ResidualBootstrap, // resample the fit residuals with replacement
+  NoiseInjection,    // add gaussian noise with the residual variance
+};
+
+template <typename T> struct Uncertainty {
+  /* Confidence interval bounds and standard deviation per constituent, phases
+   * in radians. */
+  std::vector<T> amplitudes_low;
+  std::vector<T> amplitudes_high;
+  std::vector<T> amplitudes_std;
+  std::vector<T> phases_low;
+  std::vector<T> phases_high;
+  std::vector<T> phases_std;
+};
+
+template <typename T> struct Candidate {
+  long int index; // position in the candidate pulsations
+  T pulsation;
+  T power; // fraction of the residual variance explained alone
+};
+
+} // namespace Tide
+
+template <typename T> class Workspace {
+  /* Buffers for repeated fits of up to max_samples times and max_pulsations
+   * pulsations, once allocated the fits, series and errors computed with it
+   * don't allocate. */
+public:
+  // rows reduced at once in the QR factorisation
+  static constexpr long int block = 256;
+
+  long int max_samples;
+  long int max_pulsations;
+
+  Eigen::Matrix<T, Eigen::Dynamic, Eigen::Dynamic> A;
+  Eigen::Matrix<T, Eigen::Dynamic, Eigen::Dynamic> r_factor;
+  Eigen::Matrix<T, Eigen::Dynamic, 1> qt_heights;
+  Eigen::Matrix<T, Eigen::Dynamic, 1> projected;
+  Eigen::Matrix<T, Eigen::Dynamic, 1> coefficients;
+  Eigen::Matrix<T, Eigen::Dynamic, 1> previous;
+  Eigen::Matrix<T, Eigen::Dynamic, 1> column_dots;
+  Eigen::Matrix<T, Eigen::Dynamic, Eigen::Dynamic> block_rows;
+  Eigen::Matrix<T, Eigen::Dynamic, 1> block_heights;
+  Eigen::JacobiSVD<Eigen::Matrix<T, Eigen::Dynamic, Eigen::Dynamic>,
+                   Eigen::NoQRPreconditioner>
+      svd;
+  std::vector<T> series;
+  std::vector<T> weights;
+
+  Workspace(long int max_samples, long int max_pulsations)
+      : max_samples(max_samples), max_pulsations(max_pulsations),
+        A(max_samples, max_pulsations * 2),
+        r_factor(max_pulsations * 2, max_pulsations * 2),
+        qt_heights(max_pulsations * 2), projected(max_pulsations * 2),
+        coefficients(max_pulsations * 2), previous(max_pulsations * 2),
+        column_dots(max_pulsations * 2), block_rows(block, max_pulsations * 2),
+        block_heights(block),
+        svd(max_pulsations * 2, max_pulsations * 2,
+            Eigen::ComputeFullU | Eigen::ComputeFullV),
+        series(max_samples), weights(max_samples) {};
+};
+
 template <typename T> class Components {
 public:
   std::vector<T> pulsations;
@@ -17,6 +88,44 @@ public:
   void harmonic_analysis(const std::vector<T> &times,
                          const std::vector<T> &heights);
 
+  auto harmonic_series(std::span<const T> t, Workspace<T> &ws)
+      -> std::span<const T>;
+
+  auto harmonic_series_approx(const std::vector<T> &t, T tolerance,
+                              T &max_error) -> std::vector<T>;
+
+  void harmonic_analysis(std::span<const T> times, std::span<const T> heights,
+                         Workspace<T> &ws);
+
+  void harmonic_analysis(const std::vector<T> &times,
+                         const std::vector<T> &heights,
+                         const std::vector<T> &weights);
+
+  void harmonic_analysis(std::span<const T> times, std::span<const T> heights,
+                         std::span<const T> weights, Workspace<T> &ws);
+
+  auto harmonic_analysis_robust(std::span<const T> times,
+                                std::span<const T> heights,
+                                std::span<const T> weights,
+                                Tide::Robust method, Workspace<T> &ws,
+                                int max_iterations = 30)
+      -> std::span<const T>;
+
+  auto harmonic_analysis_columns(
+      const std::vector<T> &times,
+      const Eigen::Matrix<T, Eigen::Dynamic, Eigen::Dynamic> &heights)
+      -> std::vector<Components<T>>;
+
+  auto uncertainty(const std::vector<T> &times, const std::vector<T> &heights,
+                   int replicates, Tide::Resampling method,
+                   T confidence = 0.95, unsigned int seed = 0)
+      -> Tide::Uncertainty<T>;
+
+  auto screen_candidates(const std::vector<T> &times,
+                         const std::vector<T> &heights,
+                         const std::vector<T> &candidates, int max_count)
+      -> std::vector<Tide::Candidate<T>>;
+
   void set_amplitudes(const std::vector<T> &amplitudes_in);
   void set_amplitudes(const T *amplitudes_in, int size);
 
@@ -30,6 +139,13 @@ public:
   auto error_mean(const std::vector<T> &t, const std::vector<T> &h) -> T;
   auto error_2(const std::vector<T> &t, const std::vector<T> &h) -> T;
 
+  auto error_inf(std::span<const T> t, std::span<const T> h, Workspace<T> &ws)
+      -> T;
+  auto error_mean(std::span<const T> t, std::span<const T> h, Workspace<T> &ws)
+      -> T;
+  auto error_2(std::span<const T> t, std::span<const T> h, Workspace<T> &ws)
+      -> T;
+
   Components() = default;
 
   Components(const std::vector<T> &pulsations) : pulsations(pulsations) {};
@@ -48,9 +164,21 @@ private:
   auto build_lsq_matrix(const std::vector<T> &t)
       -> Eigen::Matrix<T, Eigen::Dynamic, Eigen::Dynamic>;
 
-  auto extract_amplitudes(Eigen::Matrix<T, Eigen::Dynamic, 1> &X);
+  auto extract_amplitudes(
+      const Eigen::Ref<const Eigen::Matrix<T, Eigen::Dynamic, 1>> &X);
+
+  auto extract_phases(
+      const Eigen::Ref<const Eigen::Matrix<T, Eigen::Dynamic, 1>> &X);
+
+  void check_workspace(long int m, const Workspace<T> &ws);
 
-  auto extract_phases(Eigen::Matrix<T, Eigen::Dynamic, 1> &X);
+  void fill_series(const T *t, long int m, T *h);
+
+  void series_derivative(const std::vector<T> &t, std::vector<T> &h,
+                         std::vector<T> &dh);
+
+  void solve_least_squares(long int m, const T *heights, const T *weights,
+                           Workspace<T> &ws);
 };
 
 namespace Tide {
@@ -60,6 +188,22 @@ void get_constituants_const(std::vector<std::string> &names,
 
 template <typename T> auto mean(std::vector<T> &x) -> T;
 
+enum class Layout {
+  TimeMajor,    // one row per time, one column per station
+  StationMajor, // one row per station, one column per time
+};
+
+template <typename T>
+auto station_coefficients(const std::vector<Components<T>> &stations)
+    -> Eigen::Matrix<T, Eigen::Dynamic, Eigen::Dynamic>;
+
+template <typename T>
+auto predict_stations(
+    const std::vector<T> &pulsations,
+    const Eigen::Matrix<T, Eigen::Dynamic, Eigen::Dynamic> &coefficients,
+    const std::vector<T> &times, Layout layout)
+    -> Eigen::Matrix<T, Eigen::Dynamic, Eigen::Dynamic>;
+
 const std::map<std::string, double> TIDAL_CONST{
     {"M2", 28.9841042}, // Principal lunar semidiurnal degrees/hour
     {"S2", 30.0000000}, // Principal solar semidiurnal
@@ -88,6 +232,18 @@ void read_csv_string_units(const std::string &csv, char sep, int col_t,
                            std::vector<double> &value,
                            std::string &datetime_str);
 
+void read_csv_string(
+    const std::string &csv, const char *format, char sep, int col_t,
+    const std::vector<int> &cols_h, std::vector<double> &time,
+    Eigen::Matrix<double, Eigen::Dynamic, Eigen::Dynamic> &values,
+    std::string &datetime_str);
+
+void read_csv_string_units(
+    const std::string &csv, char sep, int col_t, const std::vector<int> &cols_h,
+    double units, std::vector<double> &time,
+    Eigen::Matrix<double, Eigen::Dynamic, Eigen::Dynamic> &values,
+    std::string &datetime_str);
+
 void read_csv_data(std::string fname, std::vector<double> &time,
                    std::vector<double> &value);
 
@@ -0,0 +1,628 @@
+#include "tide_harmonics.hpp"
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <cstdio>
+#include <cstring>
+#include <future>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <shared_mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <tuple>
+#include <vector>
+
+/* Local prediction service. The constituents of the stations stay in memory
+ * and the predictions requested at the same time by several clients on the
+ * same time axis are evaluated together with Tide::predict_stations.
+ *
+ * One request per line on a unix socket, one JSON object per line back :
+ *   load <station> <n> <pulsation> <amplitude> <phase> ... (n triplets)
+ *   predict <station> <t0> <dt> <count>   heights at t0 + i dt, in hours
+ *   stats                                 counters of the service
+ */
+
+using Clock = std::chrono::steady_clock;
+
+// how long the first prediction of a batch waits for others to join it
+constexpr auto BATCH_WINDOW = std::chrono::microseconds(500);
+constexpr long int MAX_COUNT{10000000};
+// longest request line, a load of a few thousand constituents
+constexpr std::size_t MAX_LINE{1 << 20};
+// pause of the accept loop when out of file descriptors
+constexpr auto ACCEPT_RETRY = std::chrono::milliseconds(100);
+
+struct Counters {
+  std::atomic<long int> requests{0};
+  std::atomic<long int> predictions{0};
+  std::atomic<long int> batches{0};
+  std::atomic<long int> heights{0};
+  std::atomic<long int> latency_us_total{0};
+  std::atomic<long int> latency_us_max{0};
+  Clock::time_point start{Clock::now()};
+};
+
+class Stations {
+public:
+  void set(const std::string &name, Components<double> components) {
+    std::unique_lock lock(mutex);
+    stations.insert_or_assign(name, std::move(components));
+  }
+
+  auto get(const std::string &name) -> std::optional<Components<double>> {
+    std::shared_lock lock(mutex);
+    auto it = stations.find(name);
+    if (it == stations.end()) {
+      return std::nullopt;
+    }
+    return it->second;
+  }
+
+private:
+  std::shared_mutex mutex;
+  std::map<std::string, Components<double>> stations;
+};
+
+struct Prediction {
+  std::string station;
+  double t0;
+  double dt;
+  long int count;
+  std::promise<std::vector<double>> result;
+};
+
+class Batcher {
+  /* Collects the pending predictions and evaluates those sharing a time axis
+   * and a set of pulsations with a single basis. */
+public:
+  Batcher(Stations &stations, Counters &counters)
+      : stations(stations), counters(counters),
+        thread(&Batcher::run, this) {};
+
+  Batcher(const Batcher &) = delete;
+  auto operator=(const Batcher &) -> Batcher & = delete;
+
+  ~Batcher() {
+    {
+      std::lock_guard lock(mutex);
+      stopping = true;
+    }
+    wake.notify_all();
+    thread.join();
+  }
+
+  auto submit(const std::string &station, double t0, double dt, long int count)
+      -> std::future<std::vector<double>> {
+    auto prediction =
+        std::make_unique<Prediction>(Prediction{station, t0, dt, count, {}});
+    auto future = prediction->result.get_future();
+    {
+      std::lock_guard lock(mutex);
+      pending.push_back(std::move(prediction));
+    }
+    wake.notify_one();
+    return future;
+  }
+
+private:
+  Stations &stations;
+  Counters &counters;
+  std::mutex mutex;
+  std::condition_variable wake;
+  std::vector<std::unique_ptr<Prediction>> pending;
+  bool stopping{false};
+  std::thread thread;
+
+  void run() {
+    while (true) {
+      std::vector<std::unique_ptr<Prediction>> batch;
+      {
+        std::unique_lock lock(mutex);
+        wake.wait(lock, [&] { return stopping || !pending.empty(); });
+        if (stopping && pending.empty()) {
+          return;
+        }
+        // leave time to the concurrent requests to arrive
+        wake.wait_for(lock, BATCH_WINDOW, [&] { return stopping; });
+        batch.swap(pending);
+      }
+      evaluate(batch);
+    }
+  }
+
+  void evaluate(std::vector<std::unique_ptr<Prediction>> &batch) {
+    using Axis = std::tuple<double, double, long int>;
+    using Group = std::pair<Axis, std::vector<double>>;
+    std::map<Group, std::vector<std::pair<Prediction *, Components<double>>>>
+        groups;
+
+    // a failure, such as a bad_alloc for a large count, is sent to the
+    // clients it concerns instead of ending the thread
+    for (auto &prediction : batch) {
+      try {
+        std::optional<Components<double>> components =
+            stations.get(prediction->station);
+        if (!components) {
+          throw std::runtime_error("unknown station " + prediction->station);
+        }
+        Group key{{prediction->t0, prediction->dt, prediction->count},
+                  components->pulsations};
+        groups[key].emplace_back(prediction.get(), std::move(*components));
+      } catch (...) {
+        prediction->result.set_exception(std::current_exception());
+      }
+    }
+
+    for (auto &[key, members] : groups) {
+      long int answered = 0;
+      try {
+        auto [t0, dt, count] = key.first;
+        std::vector<double> t(count);
+        for (long int i = 0; i < count; ++i) {
+          t[i] = t0 + dt * (double)i;
+        }
+
+        std::vector<Components<double>> components;
+        for (auto &member : members) {
+          components.push_back(std::move(member.second));
+        }
+        auto C = Tide::station_coefficients(components);
+        auto H = Tide::predict_stations(key.second, C, t,
+                                        Tide::Layout::StationMajor);
+
+        for (; answered < (long int)members.size(); ++answered) {
+          std::vector<double> h(count);
+          for (long int i = 0; i < count; ++i) {
+            h[i] = H(answered, i);
+          }
+          members[answered].first->result.set_value(std::move(h));
+        }
+        counters.batches++;
+        counters.heights += count * (long int)members.size();
+      } catch (...) {
+        for (; answered < (long int)members.size(); ++answered) {
+          members[answered].first->result.set_exception(
+              std::current_exception());
+        }
+      }
+    }
+  }
+};
+
+auto json_string(const std::string &str) -> std::string {
+  std::string quoted = "\"";
+  for (char c : str) {
+    if (c == '"' || c == '\\') {
+      quoted.push_back('\\');
+    }
+    if (c != '\n') {
+      quoted.push_back(c);
+    }
+  }
+  return quoted + "\"";
+}
+
+auto json_error(const std::string &msg) -> std::string {
+  return "{\"ok\":false,\"error\":" + json_string(msg) + "}";
+}
+
+auto json_number(double x) -> std::string {
+  std::array<char, 32> buffer{};
+  std::snprintf(buffer.data(), buffer.size(), "%.17g", x);
+  return buffer.data();
+}
+
+class Server {
+public:
+  explicit Server(std::string path) : path(std::move(path)) {};
+
+  Server(const Server &) = delete;
+  auto operator=(const Server &) -> Server & = delete;
+
+  ~Server() { stop(); }
+
+  void start() {
+    listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listen_fd < 0) {
+      throw std::runtime_error("can't create socket");
+    }
+    sockaddr_un addr = unix_address(path);
+    unlink(path.c_str());
+    if (bind(listen_fd, (sockaddr *)&addr, sizeof(addr)) < 0 ||
+        listen(listen_fd, 64) < 0) {
+      close(listen_fd);
+      listen_fd = -1;
+      throw std::runtime_error("can't listen on " + path);
+    }
+    accept_thread = std::thread(&Server::accept_loop, this, listen_fd);
+  }
+
+  void stop() {
+    if (listen_fd < 0) {
+      return;
+    }
+    stopping = true;
+    shutdown(listen_fd, SHUT_RDWR);
+    close(listen_fd);
+    listen_fd = -1;
+    accept_thread.join();
+    {
+      std::lock_guard lock(mutex);
+      for (int fd : client_fds) {
+        shutdown(fd, SHUT_RDWR);
+      }
+    }
+    for (auto &[id, thread] : client_threads) {
+      thread.join();
+    }
+    client_threads.clear();
+    finished_threads.clear();
+    unlink(path.c_str());
+  }
+
+  static auto unix_address(const std::string &path) -> sockaddr_un {
+    sockaddr_un addr{};
+    addr.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(addr.sun_path)) {
+      throw std::runtime_error("socket path too long : " + path);
+    }
+    std::copy(path.begin(), path.end(), addr.sun_path);
+    return addr;
+  }
+
+private:
+  std::string path;
+  int listen_fd{-1};
+  std::atomic<bool> stopping{false};
+  std::thread accept_thread;
+  std::mutex mutex;
+  std::vector<int> client_fds;
+  std::map<std::thread::id, std::thread> client_threads;
+  // clients gone, their thread is joined at the next connection
+  std::vector<std::thread::id> finished_threads;
+  Stations stations;
+  Counters counters;
+  Batcher batcher{stations, counters};
+
+  void accept_loop(int listening) {
+    while (true) {
+      int fd = accept(listening, nullptr, nullptr);
+      if (fd < 0) {
+        // stop() closed the socket, or the socket itself is unusable
+        if (stopping || errno == EBADF || errno == EINVAL ||
+            errno == ENOTSOCK) {
+          return;
+        }
+        // EINTR, ECONNABORTED... only lose this connection, wait for some
+        // descriptors to be released when out of them
+        if (errno == EMFILE || errno == ENFILE || errno == ENOBUFS ||
+            errno == ENOMEM) {
+          std::this_thread::sleep_for(ACCEPT_RETRY);
+        }
+        continue;
+      }
+      std::lock_guard lock(mutex);
+      for (auto id : finished_threads) {
+        client_threads.at(id).join();
+        client_threads.erase(id);
+      }
+      finished_threads.clear();
+      client_fds.push_back(fd);
+      std::thread thread(&Server::serve_client, this, fd);
+      client_threads.emplace(thread.get_id(), std::move(thread));
+    }
+  }
+
+  void serve_client(int fd) {
+    std::string buffer;
+    std::array<char, 4096> chunk{};
+    bool open = true;
+    while (open) {
+      auto n = recv(fd, chunk.data(), chunk.size(), 0);
+      if (n <= 0) {
+        break;
+      }
+      buffer.append(chunk.data(), n);
+      std::size_t end = 0;
+      while (open && (end = buffer.find('\n')) != std::string::npos) {
+        std::string response = handle(buffer.substr(0, end)) + "\n";
+        buffer.erase(0, end + 1);
+        open = send_all(fd, response);
+      }
+      if (open && buffer.size() > MAX_LINE) {
+        // the next request can't be found, the connection is dropped
+        send_all(fd, json_error("request longer than " +
+                                std::to_string(MAX_LINE) + " bytes") +
+                         "\n");
+        open = false;
+      }
+    }
+    std::lock_guard lock(mutex);
+    client_fds.erase(std::find(client_fds.begin(), client_fds.end(), fd));
+    close(fd);
+    finished_threads.push_back(std::this_thread::get_id());
+  }
+
+  auto handle(const std::string &line) -> std::string {
+    auto begin = Clock::now();
+    counters.requests++;
+    std::istringstream ss(line);
+    std::string command;
+    ss >> command;
+
+    std::string response;
+    try {
+      if (command == "load") {
+        response = load(ss);
+      } else if (command == "predict") {
+        response = predict(ss);
+      } else if (command == "stats") {
+        response = stats();
+      } else {
+        response = json_error("unknown command " + command);
+      }
+    } catch (const std::exception &e) {
+      response = json_error(e.what());
+    }
+
+    auto latency = std::chrono::duration_cast<std::chrono::microseconds>(
+                       Clock::now() - begin)
+                       .count();
+    counters.latency_us_total += latency;
+    long int max = counters.latency_us_max;
+    while (latency > max &&
+           !counters.latency_us_max.compare_exchange_weak(max, latency)) {
+    }
+    return response;
+  }
+
+  auto load(std::istringstream &ss) -> std::string {
+    std::string name;
+    long int n{0};
+    if (!(ss >> name >> n) || n <= 0) {
+      return json_error("usage : load <station> <n> (<pulsation> "
+                        "<amplitude> <phase>) x n");
+    }
+    std::vector<double> pulsations(n);
+    std::vector<double> amplitudes(n);
+    std::vector<double> phases(n);
+    for (long int j = 0; j < n; ++j) {
+      if (!(ss >> pulsations[j] >> amplitudes[j] >> phases[j])) {
+        return json_error("expected " + std::to_string(n) + " constituents");
+      }
+    }
+    stations.set(name, Components(pulsations, amplitudes, phases));
+    return "{\"ok\":true}";
+  }
+
+  auto predict(std::istringstream &ss) -> std::string {
+    std::string name;
+    double t0{0};
+    double dt{0};
+    long int count{0};
+    if (!(ss >> name >> t0 >> dt >> count) || count <= 0 ||
+        count > MAX_COUNT) {
+      return json_error("usage : predict <station> <t0> <dt> <count>");
+    }
+    counters.predictions++;
+    std::vector<double> h = batcher.submit(name, t0, dt, count).get();
+
+    std::string response = "{\"ok\":true,\"station\":" + json_string(name) +
+                           ",\"t0\":" + json_number(t0) +
+                           ",\"dt\":" + json_number(dt) + ",\"heights\":[";
+    for (long int i = 0; i < (long int)h.size(); ++i) {
+      if (i > 0) {
+        response += ",";
+      }
+      response += json_number(h[i]);
+    }
+    return response + "]}";
+  }
+
+  auto stats() -> std::string {
+    double uptime =
+        std::chrono::duration<double>(Clock::now() - counters.start).count();
+    long int requests = counters.requests;
+    long int predictions = counters.predictions;
+    long int batches = counters.batches;
+    long int heights = counters.heights;
+    std::ostringstream out;
+    out << "{\"ok\":true,\"uptime_s\":" << json_number(uptime)
+        << ",\"requests\":" << requests << ",\"predictions\":" << predictions
+        << ",\"batches\":" << batches << ",\"heights\":" << heights
+        << ",\"mean_latency_us\":"
+        << json_number(requests > 0 ? (double)counters.latency_us_total /
+                                          (double)requests
+                                    : 0.0)
+        << ",\"max_latency_us\":" << counters.latency_us_max
+        << ",\"heights_per_s\":" << json_number((double)heights / uptime)
+        << "}";
+    return out.str();
+  }
+
+  static auto send_all(int fd, const std::string &data) -> bool {
+    std::size_t sent = 0;
+    while (sent < data.size()) {
+      auto n = send(fd, data.data() + sent, data.size() - sent, MSG_NOSIGNAL);
+      if (n <= 0) {
+        return false;
+      }
+      sent += n;
+    }
+    return true;
+  }
+};
+
+auto query(const std::string &path, const std::string &request)
+    -> std::string {
+  /* sends one request and returns the response line */
+
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  sockaddr_un addr = Server::unix_address(path);
+  if (fd < 0 || connect(fd, (sockaddr *)&addr, sizeof(addr)) < 0) {
+    if (fd >= 0) {
+      close(fd);
+    }
+    throw std::runtime_error("can't connect to " + path);
+  }
+
+  std::string line = request + "\n";
+  std::size_t sent = 0;
+  while (sent < line.size()) {
+    auto n = send(fd, line.data() + sent, line.size() - sent, MSG_NOSIGNAL);
+    if (n <= 0) {
+      close(fd);
+      throw std::runtime_error("can't send to " + path);
+    }
+    sent += n;
+  }
+
+  std::string response;
+  std::array<char, 4096> chunk{};
+  while (response.empty() || response.back() != '\n') {
+    auto n = recv(fd, chunk.data(), chunk.size(), 0);
+    if (n <= 0) {
+      break;
+    }
+    response.append(chunk.data(), n);
+  }
+  close(fd);
+  if (!response.empty() && response.back() == '\n') {
+    response.pop_back();
+  }
+  return response;
+}
+
+auto parse_heights(const std::string &response) -> std::vector<double> {
+  std::vector<double> h;
+  auto begin = response.find('[');
+  auto end = response.find(']');
+  if (begin == std::string::npos || end == std::string::npos) {
+    return h;
+  }
+  std::string values = response.substr(begin + 1, end - begin - 1);
+  std::replace(values.begin(), values.end(), ',', ' ');
+  std::istringstream ss(values);
+  double v{0};
+  while (ss >> v) {
+    h.push_back(v);
+  }
+  return h;
+}
+
+auto selftest() -> int {
+  /* Runs a server and concurrent clients in this process, checks the
+   * predictions against Components::harmonic_series. */
+
+  std::string path = "/tmp/tide_server_selftest_" + std::to_string(getpid());
+  Server server(path);
+  server.start();
+
+  std::vector<std::string> names;
+  std::vector<double> pulsations;
+  Tide::get_constituants_const(names, pulsations);
+
+  const int n_stations = 64;
+  std::vector<Components<double>> stations;
+  for (int s = 0; s < n_stations; ++s) {
+    std::vector<double> amplitudes;
+    std::vector<double> phases;
+    std::string request = "load station" + std::to_string(s) + " " +
+                          std::to_string(pulsations.size());
+    for (int j = 0; j < (int)pulsations.size(); ++j) {
+      amplitudes.push_back(0.1 * (1 + (j + s) % 7));
+      phases.push_back(0.37 * (j * s % 11));
+      request += " " + json_number(pulsations[j]) + " " +
+                 json_number(amplitudes[j]) + " " + json_number(phases[j]);
+    }
+    stations.emplace_back(pulsations, amplitudes, phases);
+    if (query(path, request) != "{\"ok\":true}") {
+      std::cout << "selftest, load failed\n";
+      return 1;
+    }
+  }
+
+  const long int count = 2000;
+  std::vector<double> t(count);
+  for (long int i = 0; i < count; ++i) {
+    t[i] = 100.0 + 0.5 * (double)i;
+  }
+
+  std::vector<double> errors(n_stations, 1.0);
+  std::vector<std::thread> clients;
+  for (int s = 0; s < n_stations; ++s) {
+    clients.emplace_back([&, s]() {
+      std::string response = query(path, "predict station" +
+                                              std::to_string(s) + " 100 0.5 " +
+                                              std::to_string(count));
+      std::vector<double> h = parse_heights(response);
+      std::vector<double> h_ref = stations[s].harmonic_series(t);
+      if (h.size() != h_ref.size()) {
+        return;
+      }
+      double error{0};
+      for (long int i = 0; i < count; ++i) {
+        error = std::max(error, std::abs(h[i] - h_ref[i]));
+      }
+      errors[s] = error;
+    });
+  }
+  for (auto &client : clients) {
+    client.join();
+  }
+
+  double error = *std::max_element(errors.begin(), errors.end());
+  std::string unknown = query(path, "predict nowhere 0 1 10");
+  std::string stats = query(path, "stats");
+  server.stop();
+
+  std::cout << "selftest, error inf : " << error << "\n";
+  std::cout << "selftest, unknown station : " << unknown << "\n";
+  std::cout << "selftest, stats : " << stats << "\n";
+  bool ok = error < 1.0e-11 && unknown.starts_with("{\"ok\":false");
+  std::cout << (ok ? "selftest passed\n" : "selftest failed\n");
+  return ok ? 0 : 1;
+}
+
+auto main(int argc, char *argv[]) -> int {
+  std::string mode = argc > 1 ? argv[1] : "";
+
+  try {
+    if (mode == "serve" && argc == 3) {
+      Server server(argv[2]);
+      server.start();
+      std::cout << "Serving on " << argv[2] << "\n";
+      while (true) {
+        std::this_thread::sleep_for(std::chrono::hours(24));
+      }
+    }
+    if (mode == "query" && argc == 4) {
+      std::cout << query(argv[2], argv[3]) << "\n";
+      return 0;
+    }
+    if (mode == "selftest" && argc == 2) {
+      return selftest();
+    }
+  } catch (const std::exception &e) {
+    std::cout << "Error, " << e.what() << "\n";
+    return 1;
+  }
+
+  std::cout << "usage : " << argv[0] << " serve <socket path>\n"
+            << "        " << argv[0] << " query <socket path> <request>\n"
+            << "        " << argv[0] << " selftest\n";
+  return 1;
+}